@@ -0,0 +1,58 @@
+#ifndef CHAT_CAPTURE_H
+#define CHAT_CAPTURE_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_LENGTH 8
+
+/*
+ * A capture file is CAPTURE_MAGIC followed by records of
+ *   u8 event | varint microseconds since the previous record | varint connection ID
+ * and, for CAPTURE_DATA only, varint length | command bytes (without the line terminator).
+ */
+enum CaptureEvent
+{
+  CAPTURE_OPEN  = 1, // Connection accepted
+  CAPTURE_DATA  = 2, // One command line received
+  CAPTURE_CLOSE = 3, // Connection closed
+};
+
+struct CaptureRecord
+{
+  enum CaptureEvent event;
+  uint64_t          timestamp_us;          // Microseconds since the capture started
+  uint64_t          connection_id;         // Unique per connection within a capture
+  size_t            length;                // Bytes in data, CAPTURE_DATA only
+  char              data[MAX_BUFFER_SIZE]; // NUL terminated command line
+};
+
+struct CaptureWriter
+{
+  pthread_mutex_t mutex;
+  FILE           *file;
+  struct timespec start;   // Monotonic time of timestamp 0
+  uint64_t        last_us; // Timestamp of the previous record
+};
+
+struct CaptureReader
+{
+  FILE    *file;
+  uint64_t timestamp_us; // Timestamp of the previous record
+};
+
+int  capture_writer_open(struct CaptureWriter *writer, const char *path);
+void capture_writer_record(
+    struct CaptureWriter *writer, enum CaptureEvent event, uint64_t connection_id, const char *data, size_t length
+);
+void capture_writer_flush(struct CaptureWriter *writer);
+void capture_writer_close(struct CaptureWriter *writer);
+
+int  capture_reader_open(struct CaptureReader *reader, const char *path);
+int  capture_reader_next(struct CaptureReader *reader, struct CaptureRecord *record);
+void capture_reader_close(struct CaptureReader *reader);
+
+#endif // CHAT_CAPTURE_H
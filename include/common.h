@@ -1,6 +1,8 @@
 #ifndef CHAT_COMMON_H
 #define CHAT_COMMON_H
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -25,4 +27,21 @@
 
 #define PORT 8080
 
+#define TIMER_TICK_MS 100
+#define TIMER_TICKS_PER_SECOND (1000 / TIMER_TICK_MS)
+#define HANDSHAKE_TIMEOUT_SECONDS 10
+#define IDLE_TIMEOUT_SECONDS 300
+#define PONG_TIMEOUT_SECONDS 30
+
+#define IO_THREAD_COUNT 2
+#define WORKER_COUNT 4
+#define OUTPUT_BUFFER_LIMIT (256 * 1024)
+
+#define FANOUT_BATCH_THRESHOLD 8
+
+#define SEARCH_INDEX_DIRECTORY "/tmp"
+#define SEARCH_MEMTABLE_DOCUMENTS 1024
+#define SEARCH_RETAINED_MESSAGES 100000
+#define SEARCH_RESULT_LIMIT 10
+
 #endif // CHAT_COMMON_H
@@ -0,0 +1,33 @@
+#ifndef CHAT_MPSC_QUEUE_H
+#define CHAT_MPSC_QUEUE_H
+
+#include "common.h"
+
+#include <stdatomic.h>
+
+struct MpscNode
+{
+  _Atomic(struct MpscNode *) next;
+};
+
+/*
+ * Intrusive lock-free multi-producer single-consumer queue. Any thread may push, only the owning thread may pop.
+ * The consumer sleeps on event_fd, which producers only write to when the consumer announced it is waiting.
+ */
+struct MpscQueue
+{
+  _Atomic(struct MpscNode *) head;       // Most recently pushed node, producers swap themselves in here
+  struct MpscNode           *tail;       // Next node to pop, only touched by the consumer
+  struct MpscNode            stub;       // Placeholder that keeps the list non-empty
+  atomic_int                 is_waiting; // 1 while the consumer is (about to be) blocked on event_fd
+  int                        event_fd;   // Non-blocking eventfd used to wake the consumer
+};
+
+int              mpsc_queue_init(struct MpscQueue *queue);
+void             mpsc_queue_push(struct MpscQueue *queue, struct MpscNode *node);
+struct MpscNode *mpsc_queue_pop(struct MpscQueue *queue);
+int              mpsc_queue_prepare_wait(struct MpscQueue *queue);
+void             mpsc_queue_finish_wait(struct MpscQueue *queue);
+struct MpscNode *mpsc_queue_pop_wait(struct MpscQueue *queue);
+
+#endif // CHAT_MPSC_QUEUE_H
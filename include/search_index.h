@@ -0,0 +1,74 @@
+#ifndef CHAT_SEARCH_INDEX_H
+#define CHAT_SEARCH_INDEX_H
+
+#include "common.h"
+#include "mpsc_queue.h"
+
+#include <stdint.h>
+
+#define SEARCH_MAX_SEGMENTS 32    // Mapped segments per index, merging keeps the count logarithmic in practice
+#define SEARCH_MAX_FROZEN 8       // Full memtables per index waiting to be written out
+#define SEARCH_MAX_QUERY_TERMS 8  // Further query terms are ignored
+#define SEARCH_MAX_TERM_LENGTH 32 // Longer words are indexed by their prefix
+
+struct SearchMemTable; // Documents indexed in memory since the last flush, immutable once frozen
+struct SearchSegment;  // Immutable segment file mapped read-only
+
+// Background flush or merge handed to the indexer thread, each index has at most one outstanding
+struct SearchIndexJob
+{
+  struct MpscNode        node;                         // Indexer queue membership, must stay first
+  struct SearchIndex    *index;                        // Index the job belongs to
+  struct SearchMemTable *memtables[SEARCH_MAX_FROZEN]; // Flush: frozen memtables, oldest first
+  int                    memtable_count;               // Flush: number of memtables
+  struct SearchSegment  *segments[2];                  // Merge: neighbouring segments, oldest first
+  int                    segment_start;                // Merge: index of segments[0] in the index's segment list
+  int                    segment_count;                // Merge: number of segments
+  uint32_t               retain_from;                  // Documents older than this are dropped while rewriting
+  struct SearchSegment  *result;                       // Segment replacing the inputs, NULL if writing it failed
+};
+
+struct SearchIndexer
+{
+  pthread_t        thread;
+  struct MpscQueue queue;     // Jobs waiting to run
+  const char      *directory; // Where segment files are created
+};
+
+/*
+ * Full-text index over one guild's messages. New messages go to an in-memory table that is frozen once full and
+ * written out as a segment on the indexer thread, and neighbouring segments of similar size are merged there too.
+ * Only the owning thread may call into an index. It picks up finished jobs the next time it does.
+ */
+struct SearchIndex
+{
+  struct SearchIndexer  *indexer;
+  struct SearchMemTable *active;                        // Receives new documents, NULL until the first one
+  struct SearchMemTable *frozen[SEARCH_MAX_FROZEN];     // Full memtables not yet replaced by a segment, oldest first
+  int                    frozen_count;                  // Entries used in frozen
+  struct SearchSegment  *segments[SEARCH_MAX_SEGMENTS]; // Segments covering consecutive documents, oldest first
+  int                    segment_count;                 // Entries used in segments
+  uint32_t               next_document;                 // ID the next document is assigned
+  uint32_t               retry_after;                   // After a failed job no other is started before this ID
+  struct SearchIndexJob  job;                           // Storage for the outstanding job
+  int                    is_job_running;                // 1 from submitting the job until its result is applied
+  atomic_int             is_job_done;                   // Set with release ordering once job.result is final
+};
+
+// Points into the index, valid until the next call on it
+struct SearchHit
+{
+  uint32_t    document;
+  int         channel_id;
+  const char *username;
+  int         username_length;
+  const char *text;
+  int         text_length;
+};
+
+int  search_indexer_start(struct SearchIndexer *indexer, const char *directory);
+void search_index_init(struct SearchIndex *index, struct SearchIndexer *indexer);
+int  search_index_add(struct SearchIndex *index, int channel_id, const char *username, const char *text);
+int  search_index_query(struct SearchIndex *index, const char *query, struct SearchHit *hits, int max_hits);
+
+#endif // CHAT_SEARCH_INDEX_H
@@ -0,0 +1,48 @@
+#ifndef CHAT_TIMER_WHEEL_H
+#define CHAT_TIMER_WHEEL_H
+
+#include "common.h"
+
+#include <stdatomic.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+struct TimerLink
+{
+  struct TimerLink *next;
+  struct TimerLink *prev;
+};
+
+struct Timer
+{
+  struct TimerLink link;                                      // Slot list membership, must stay first
+  unsigned long    expires;                                   // Absolute tick the timer fires at
+  int              is_pending;                                // 1 if linked into a slot or the expired list
+  void             (*callback)(struct Timer *timer, void *arg); // Invoked from the timer thread
+  void            *arg;                                       // Opaque argument passed to the callback
+};
+
+struct TimerWheel
+{
+  pthread_mutex_t  mutex;
+  pthread_cond_t   callback_done;                             // Signalled whenever a callback returns
+  struct TimerLink slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // Level n slot holds timers 64^n ticks apart
+  struct TimerLink expired;                                   // Timers due but not yet dispatched
+  struct Timer    *running;                                   // Timer whose callback is currently executing
+  atomic_ulong     now;                                       // Current tick, only the timer thread advances it
+  struct timespec  start;                                     // Monotonic time of tick 0
+  pthread_t        thread;
+};
+
+int           timer_wheel_init(struct TimerWheel *wheel);
+int           timer_wheel_start(struct TimerWheel *wheel);
+unsigned long timer_wheel_now(struct TimerWheel *wheel);
+
+void timer_init(struct Timer *timer, void (*callback)(struct Timer *timer, void *arg), void *arg);
+void timer_arm(struct TimerWheel *wheel, struct Timer *timer, unsigned long ticks);
+void timer_cancel(struct TimerWheel *wheel, struct Timer *timer);
+
+#endif // CHAT_TIMER_WHEEL_H
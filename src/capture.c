@@ -0,0 +1,143 @@
+#include "capture.h"
+
+#define CAPTURE_WRITE_BUFFER_SIZE (64 * 1024)
+
+static void write_varint(FILE *file, uint64_t value)
+{
+  while (value >= 0x80) {
+    putc((int)(value & 0x7f) | 0x80, file);
+    value >>= 7;
+  }
+  putc((int)value, file);
+}
+
+static int read_varint(FILE *file, uint64_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = getc(file);
+    if (byte == EOF) {
+      return -1;
+    }
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return 0;
+    }
+  }
+  return -1; // Longer than any 64-bit value
+}
+
+int capture_writer_open(struct CaptureWriter *writer, const char *path)
+{
+  if ((writer->file = fopen(path, "wb")) == NULL) {
+    return -1;
+  }
+  setvbuf(writer->file, NULL, _IOFBF, CAPTURE_WRITE_BUFFER_SIZE);
+
+  if (pthread_mutex_init(&writer->mutex, NULL) != 0 || clock_gettime(CLOCK_MONOTONIC, &writer->start) == -1 ||
+      fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, writer->file) != CAPTURE_MAGIC_LENGTH) {
+    fclose(writer->file);
+    writer->file = NULL;
+    return -1;
+  }
+  writer->last_us = 0;
+  return 0;
+}
+
+void capture_writer_record(
+    struct CaptureWriter *writer, enum CaptureEvent event, uint64_t connection_id, const char *data, size_t length
+)
+{
+  struct timespec now;
+  pthread_mutex_lock(&writer->mutex);
+
+  // Taken under the lock so timestamps never go backwards between I/O threads
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_us =
+      (uint64_t)((int64_t)(now.tv_sec - writer->start.tv_sec) * 1000000 + (now.tv_nsec - writer->start.tv_nsec) / 1000);
+
+  putc((int)event, writer->file);
+  write_varint(writer->file, now_us - writer->last_us);
+  write_varint(writer->file, connection_id);
+  if (event == CAPTURE_DATA) {
+    write_varint(writer->file, length);
+    fwrite(data, 1, length, writer->file);
+  }
+  writer->last_us = now_us;
+
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+void capture_writer_flush(struct CaptureWriter *writer)
+{
+  pthread_mutex_lock(&writer->mutex);
+  if (fflush(writer->file) == EOF) {
+    perror("capture");
+  }
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+// Writes out and closes the capture. The mutex stays held so no record can follow, call it right before exiting
+void capture_writer_close(struct CaptureWriter *writer)
+{
+  pthread_mutex_lock(&writer->mutex);
+  if (fclose(writer->file) == EOF) {
+    perror("capture");
+  }
+  writer->file = NULL;
+}
+
+int capture_reader_open(struct CaptureReader *reader, const char *path)
+{
+  char magic[CAPTURE_MAGIC_LENGTH];
+  if ((reader->file = fopen(path, "rb")) == NULL) {
+    return -1;
+  }
+
+  if (fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) ||
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0) {
+    fclose(reader->file);
+    reader->file = NULL;
+    return -1;
+  }
+  reader->timestamp_us = 0;
+  return 0;
+}
+
+// Returns 1 when a record was read, 0 at the end of the capture and -1 if it is malformed
+int capture_reader_next(struct CaptureReader *reader, struct CaptureRecord *record)
+{
+  int event = getc(reader->file);
+  if (event == EOF) {
+    return 0;
+  }
+  if (event != CAPTURE_OPEN && event != CAPTURE_DATA && event != CAPTURE_CLOSE) {
+    return -1;
+  }
+
+  uint64_t delta_us, length = 0;
+  if (read_varint(reader->file, &delta_us) == -1 || read_varint(reader->file, &record->connection_id) == -1) {
+    return -1;
+  }
+  if (event == CAPTURE_DATA) {
+    if (read_varint(reader->file, &length) == -1 || length >= sizeof(record->data) ||
+        fread(record->data, 1, length, reader->file) != length) {
+      return -1;
+    }
+  }
+
+  reader->timestamp_us += delta_us;
+  record->event        = (enum CaptureEvent)event;
+  record->timestamp_us = reader->timestamp_us;
+  record->length       = (size_t)length;
+  record->data[length] = '\0';
+  return 1;
+}
+
+void capture_reader_close(struct CaptureReader *reader)
+{
+  if (reader->file != NULL) {
+    fclose(reader->file);
+    reader->file = NULL;
+  }
+}
@@ -4,6 +4,7 @@ static int socket_fd;
 char       name[MAX_USERNAME_SIZE];
 
 static void *receive_messages(void *arg);
+static void  handle_server_line(const char *server_reply);
 static void  print_prompt(void);
 static int   send_message(const char *message);
 
@@ -35,7 +36,7 @@ int main(int argc, char *argv[])
   }
 
   char buffer[MAX_BUFFER_SIZE];
-  snprintf(buffer, sizeof(buffer), "NAME %s", name);
+  snprintf(buffer, sizeof(buffer), "NAME %s\n", name);
   if (send(socket_fd, buffer, strlen(buffer), 0) == -1) {
     perror("Failed to send name");
     close(socket_fd);
@@ -80,7 +81,7 @@ int main(int argc, char *argv[])
         arg1 = strtok_r(NULL, " ", &saveptr); // Guild name
         arg2 = strtok_r(NULL, " ", &saveptr); // Channel name
         if (arg1 && arg2) {
-          snprintf(send_buffer, sizeof(send_buffer), "JOIN %s %s", arg1, arg2);
+          snprintf(send_buffer, sizeof(send_buffer), "JOIN %s %s\n", arg1, arg2);
         } else {
           fprintf(stderr, "Usage: /join <guild> <channel>\n");
           continue;
@@ -90,7 +91,7 @@ int main(int argc, char *argv[])
       } else if (strcmp(command, "createguild") == 0) {
         arg1 = strtok_r(NULL, " ", &saveptr);
         if (arg1) {
-          snprintf(send_buffer, sizeof(send_buffer), "CREATEGUILD %s", arg1);
+          snprintf(send_buffer, sizeof(send_buffer), "CREATEGUILD %s\n", arg1);
         } else {
           fprintf(stderr, "Usage: /createguild <guild_name>\n");
           continue;
@@ -100,10 +101,19 @@ int main(int argc, char *argv[])
       } else if (strcmp(command, "listchannels") == 0) {
         arg1 = strtok_r(NULL, " ", &saveptr);
         if (arg1) {
-          snprintf(send_buffer, sizeof(send_buffer), "LISTCHANNELS %s", arg1);
+          snprintf(send_buffer, sizeof(send_buffer), "LISTCHANNELS %s\n", arg1);
         } else {
           fprintf(stderr, "Usage: /listchannels <guild>\n");
         }
+      } else if (strcmp(command, "search") == 0) {
+        arg1 = strtok_r(NULL, " ", &saveptr); // Guild name
+        arg2 = strtok_r(NULL, "", &saveptr);  // Search terms
+        if (arg1 && arg2) {
+          snprintf(send_buffer, sizeof(send_buffer), "SEARCH %s %s\n", arg1, arg2);
+        } else {
+          fprintf(stderr, "Usage: /search <guild> <terms>\n");
+          continue;
+        }
       } else if (strcmp(command, "help") == 0) {
         printf(
             "Available commands:\n"
@@ -111,6 +121,7 @@ int main(int argc, char *argv[])
             "\t/leave - Leave the current guild and channel\n"
             "\t/listguilds - List all guilds\n"
             "\t/listchannels <guild> - List channels in a guild\n"
+            "\t/search <guild> <terms> - Find recent messages in a guild containing every term\n"
             "\t/quit or /exit - Exit the client\n"
         );
         continue;
@@ -120,7 +131,7 @@ int main(int argc, char *argv[])
       }
     } else {
       // Regular message
-      snprintf(send_buffer, sizeof(send_buffer), "MSG %s", buffer);
+      snprintf(send_buffer, sizeof(send_buffer), "MSG %s\n", buffer);
     }
 
     if (send_message(send_buffer) == -1) {
@@ -155,97 +166,135 @@ static int send_message(const char *message)
 static void *receive_messages(void *arg)
 {
   int     socket_fd = *(int *)arg;
-  char    server_reply[MAX_BUFFER_SIZE];
+  char    pending[MAX_BUFFER_SIZE];
+  size_t  pending_length = 0;
   ssize_t bytes_received;
 
-  while ((bytes_received = recv(socket_fd, server_reply, sizeof(server_reply) - 1, 0)) > 0) {
-    server_reply[bytes_received] = '\0';
+  // Replies can arrive several to a read or split across reads, so handle them line by line
+  while ((bytes_received = recv(socket_fd, pending + pending_length, sizeof(pending) - 1 - pending_length, 0)) > 0) {
+    pending_length += (size_t)bytes_received;
+
+    char *line = pending;
+    char *newline;
+    while ((newline = memchr(line, '\n', pending_length - (size_t)(line - pending))) != NULL) {
+      *newline = '\0';
+      handle_server_line(line);
+      line = newline + 1;
+    }
+
+    pending_length -= (size_t)(line - pending);
+    memmove(pending, line, pending_length);
+    if (pending_length == sizeof(pending) - 1) {
+      pending[pending_length] = '\0'; // Longer than the buffer, show what fits
+      handle_server_line(pending);
+      pending_length = 0;
+    }
+  }
 
-    // Clear the terminal line
-    printf("\033[K\r");
+  if (bytes_received == 0) {
+    printf("\r\033[K[Server disconnected]\n");
     fflush(stdout);
 
-    char *command, *arg1, *arg2, *arg3, *payload;
-    char *saveptr;
+    exit(0); // Exit the client gracefully
+  } else if (bytes_received == -1) {
+    perror("recv");
+  }
 
-    char temp_reply[MAX_BUFFER_SIZE];
-    strncpy(temp_reply, server_reply, sizeof(temp_reply) - 1);
-    temp_reply[sizeof(temp_reply) - 1]      = '\0';
-    temp_reply[strcspn(temp_reply, "\r\n")] = 0; // Remove trailing newline characters
+  return NULL; // Thread exit
+}
 
-    command = strtok_r(temp_reply, " ", &saveptr);
-    if (command == NULL) {
-      continue; // Skip empty messages
-    }
+static void handle_server_line(const char *server_reply)
+{
+  // Clear the terminal line
+  printf("\033[K\r");
+  fflush(stdout);
 
-    if (strcmp(command, "MSG") == 0) {
-      arg1    = strtok_r(NULL, " ", &saveptr); // Guild ID
-      arg2    = strtok_r(NULL, " ", &saveptr); // Channel ID
-      arg3    = strtok_r(NULL, " ", &saveptr); // Username
-      payload = strtok_r(NULL, "", &saveptr);  // Message payload
+  char *command, *arg1, *arg2, *arg3, *payload;
+  char *saveptr;
 
-      if (arg1 && arg2 && arg3 && payload) {
-        if (*payload == ' ') {
-          payload++; // Trim leading whitespace
-        }
+  char temp_reply[MAX_BUFFER_SIZE];
+  strncpy(temp_reply, server_reply, sizeof(temp_reply) - 1);
+  temp_reply[sizeof(temp_reply) - 1]      = '\0';
+  temp_reply[strcspn(temp_reply, "\r\n")] = 0; // Remove trailing newline characters
 
-        printf("[%s/%s] <%s>: %s\n", arg1, arg2, arg3, payload);
-      } else {
-        fprintf(stderr, "Malformed message received: %s\n", server_reply);
-      }
-    } else if (strcmp(command, "INFO") == 0) {
-      payload = strtok_r(NULL, "", &saveptr); // Get the rest of the message
-      if (payload) {
-        if (*payload == ' ') {
-          payload++; // Trim leading whitespace
-        }
-        printf("[Server INFO]: %s\n", payload);
+  command = strtok_r(temp_reply, " ", &saveptr);
+  if (command == NULL) {
+    return; // Skip empty messages
+  }
+
+  if (strcmp(command, "MSG") == 0) {
+    arg1    = strtok_r(NULL, " ", &saveptr); // Guild ID
+    arg2    = strtok_r(NULL, " ", &saveptr); // Channel ID
+    arg3    = strtok_r(NULL, " ", &saveptr); // Username
+    payload = strtok_r(NULL, "", &saveptr);  // Message payload
+
+    if (arg1 && arg2 && arg3 && payload) {
+      if (*payload == ' ') {
+        payload++; // Trim leading whitespace
       }
-    } else if (strcmp(command, "ERROR") == 0) {
-      payload = strtok_r(NULL, "", &saveptr); // Get the rest of the message
-      if (payload) {
-        if (*payload == ' ') {
-          payload++; // Trim leading whitespace
-        }
 
-        fprintf(stderr, "[Server ERROR]: %s\n", payload);
+      printf("[%s/%s] <%s>: %s\n", arg1, arg2, arg3, payload);
+    } else {
+      fprintf(stderr, "Malformed message received: %s\n", server_reply);
+    }
+  } else if (strcmp(command, "INFO") == 0) {
+    payload = strtok_r(NULL, "", &saveptr); // Get the rest of the message
+    if (payload) {
+      if (*payload == ' ') {
+        payload++; // Trim leading whitespace
+      }
+      printf("[Server INFO]: %s\n", payload);
+    }
+  } else if (strcmp(command, "ERROR") == 0) {
+    payload = strtok_r(NULL, "", &saveptr); // Get the rest of the message
+    if (payload) {
+      if (*payload == ' ') {
+        payload++; // Trim leading whitespace
       }
-    } else if (strcmp(command, "GUILDLIST") == 0) {
-      payload = strtok_r(NULL, "", &saveptr); // Get the rest of the message
-      if (payload) {
-        if (*payload == ' ') {
-          payload++; // Trim leading whitespace
-        }
 
-        printf("[Guilds]: %s\n", payload);
-      } else {
-        printf("[Guilds]: No guilds available.\n");
+      fprintf(stderr, "[Server ERROR]: %s\n", payload);
+    }
+  } else if (strcmp(command, "GUILDLIST") == 0) {
+    payload = strtok_r(NULL, "", &saveptr); // Get the rest of the message
+    if (payload) {
+      if (*payload == ' ') {
+        payload++; // Trim leading whitespace
       }
-    } else if (strcmp(command, "CHANNELLIST") == 0) {
-      arg1    = strtok_r(NULL, " ", &saveptr); // Guild name
-      payload = strtok_r(NULL, "", &saveptr);  // Get the rest of the message
-      if (arg1) {
-        if (payload && *payload == ' ') {
-          payload++; // Trim leading whitespace
-        }
-        printf("[Channels in %s]: %s\n", arg1, payload ? payload : "No channels available.");
+
+      printf("[Guilds]: %s\n", payload);
+    } else {
+      printf("[Guilds]: No guilds available.\n");
+    }
+  } else if (strcmp(command, "CHANNELLIST") == 0) {
+    arg1    = strtok_r(NULL, " ", &saveptr); // Guild name
+    payload = strtok_r(NULL, "", &saveptr);  // Get the rest of the message
+    if (arg1) {
+      if (payload && *payload == ' ') {
+        payload++; // Trim leading whitespace
       }
+      printf("[Channels in %s]: %s\n", arg1, payload ? payload : "No channels available.");
+    }
+  } else if (strcmp(command, "SEARCHRESULT") == 0) {
+    arg1 = strtok_r(NULL, " ", &saveptr); // Guild name
+    arg2 = strtok_r(NULL, " ", &saveptr); // Number of SEARCHHIT lines that follow
+    if (arg1 && arg2) {
+      printf("[Search in %s]: %s message(s) found\n", arg1, arg2);
+    }
+  } else if (strcmp(command, "SEARCHHIT") == 0) {
+    arg1    = strtok_r(NULL, " ", &saveptr); // Channel name
+    arg2    = strtok_r(NULL, " ", &saveptr); // Username
+    payload = strtok_r(NULL, "", &saveptr);  // Message payload
+    if (arg1 && arg2 && payload) {
+      printf("\t#%s <%s>: %s\n", arg1, arg2, payload);
     } else {
-      // Unknown command, print the raw server reply
-      fprintf(stderr, "%s", server_reply);
+      fprintf(stderr, "Malformed search result received: %s\n", server_reply);
     }
-
-    print_prompt(); // Print the prompt again after processing the message
+  } else if (strcmp(command, "PING") == 0) {
+    send_message("PONG\n"); // Keep the connection from being reaped as idle
+  } else {
+    // Unknown command, print the raw server reply
+    fprintf(stderr, "%s\n", server_reply);
   }
 
-  if (bytes_received == 0) {
-    printf("\r\033[K[Server disconnected]\n");
-    fflush(stdout);
-
-    exit(0); // Exit the client gracefully
-  } else if (bytes_received == -1) {
-    perror("recv");
-  }
-
-  return NULL; // Thread exit
+  print_prompt(); // Print the prompt again after processing the message
 }
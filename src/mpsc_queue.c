@@ -0,0 +1,115 @@
+#include "mpsc_queue.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+int mpsc_queue_init(struct MpscQueue *queue)
+{
+  atomic_init(&queue->stub.next, NULL);
+  atomic_init(&queue->head, &queue->stub);
+  atomic_init(&queue->is_waiting, 0);
+  queue->tail = &queue->stub;
+
+  queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return queue->event_fd == -1 ? -1 : 0;
+}
+
+static void push_node(struct MpscQueue *queue, struct MpscNode *node)
+{
+  atomic_store(&node->next, NULL);
+  struct MpscNode *prev = atomic_exchange(&queue->head, node);
+  atomic_store(&prev->next, node); // Until this store the node is pushed but not yet reachable by the consumer
+}
+
+void mpsc_queue_push(struct MpscQueue *queue, struct MpscNode *node)
+{
+  push_node(queue, node);
+
+  if (atomic_exchange(&queue->is_waiting, 0)) {
+    uint64_t one = 1;
+    if (write(queue->event_fd, &one, sizeof(one)) == -1) {
+      perror("write");
+    }
+  }
+}
+
+/*
+ * Returns NULL when the queue is empty, and also when a producer is midway through a push. The consumer then
+ * goes to sleep and is woken once that producer finishes.
+ */
+struct MpscNode *mpsc_queue_pop(struct MpscQueue *queue)
+{
+  struct MpscNode *tail = queue->tail;
+  struct MpscNode *next = atomic_load(&tail->next);
+
+  if (tail == &queue->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    queue->tail = next;
+    tail        = next;
+    next        = atomic_load(&next->next);
+  }
+
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+
+  if (tail != atomic_load(&queue->head)) {
+    return NULL;
+  }
+
+  // tail is the last node, put the stub behind it so it can be handed out
+  push_node(queue, &queue->stub);
+  next = atomic_load(&tail->next);
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+/*
+ * Announces that the consumer is about to block on event_fd. Returns 0 if something was pushed in the meantime,
+ * in which case the consumer must not block.
+ */
+int mpsc_queue_prepare_wait(struct MpscQueue *queue)
+{
+  atomic_store(&queue->is_waiting, 1);
+
+  struct MpscNode *tail = queue->tail;
+  if (tail != &queue->stub || atomic_load(&tail->next) != NULL) {
+    atomic_store(&queue->is_waiting, 0);
+    return 0;
+  }
+  return 1;
+}
+
+void mpsc_queue_finish_wait(struct MpscQueue *queue)
+{
+  atomic_store(&queue->is_waiting, 0);
+
+  uint64_t count;
+  while (read(queue->event_fd, &count, sizeof(count)) > 0) {
+  }
+}
+
+struct MpscNode *mpsc_queue_pop_wait(struct MpscQueue *queue)
+{
+  while (1) {
+    struct MpscNode *node = mpsc_queue_pop(queue);
+    if (node != NULL) {
+      return node;
+    }
+
+    if (mpsc_queue_prepare_wait(queue)) {
+      struct pollfd pfd = {queue->event_fd, POLLIN, 0};
+      if (poll(&pfd, 1, -1) == -1) {
+        perror("poll");
+      }
+      mpsc_queue_finish_wait(queue);
+    }
+  }
+}
@@ -0,0 +1,642 @@
+#include "capture.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+#define REPLAY_DRAIN_SECONDS 5 // How long to wait for more replies once the capture is exhausted
+
+enum ReplyExpectation
+{
+  EXPECT_REPLY,   // The next non-MSG line answers the command
+  EXPECT_MESSAGE, // The sender's own broadcast (or an ERROR) answers the command
+};
+
+struct PendingReply
+{
+  uint64_t              sent_ns;        // When the command was queued for sending
+  enum ReplyExpectation expectation;    // How to recognize the answer
+  const char           *payload;        // EXPECT_MESSAGE: message payload, points into the loaded capture
+  size_t                payload_length; // EXPECT_MESSAGE: bytes in payload
+};
+
+struct ReplayRecord
+{
+  enum CaptureEvent event;
+  uint64_t          timestamp_us; // Offset from the start of the capture
+  int               connection;   // Index into the connections array
+  char             *data;         // CAPTURE_DATA: command line
+  size_t            length;       // CAPTURE_DATA: bytes in data
+};
+
+struct ReplayConnection
+{
+  uint64_t             capture_id;                  // Connection ID in the capture file
+  int                  socket_fd;                   // -1 until opened and after closing
+  int                  is_closing;                  // 1 once the capture closed it, shut down after replies drain
+  int                  is_shut_down;                // 1 once our side of the socket was shut down
+  char                 input[MAX_BUFFER_SIZE];      // Received bytes not yet split into lines
+  size_t               input_length;                // Bytes used in input
+  char                *output;                      // Commands not yet accepted by the socket
+  size_t               output_length;               // Bytes used in output
+  size_t               output_capacity;             // Bytes allocated for output
+  struct PendingReply *pending;                     // Commands waiting for their reply, oldest first
+  size_t               pending_head;                // Index of the oldest pending reply
+  size_t               pending_count;               // Pending replies starting at pending_head
+  size_t               pending_capacity;            // Entries allocated for pending
+  char                 username[MAX_USERNAME_SIZE]; // Name the server knows the connection by
+};
+
+struct ReplayStats
+{
+  uint64_t  commands_sent;
+  uint64_t  lines_received;
+  uint64_t  deliveries;       // MSG lines received, including a sender's own echo
+  uint64_t  unmatched;        // Replies that did not correspond to a pending command
+  uint64_t  unanswered;       // Commands still waiting for a reply when their connection closed
+  uint64_t  connect_failures; // Captured connections that could not be opened
+  uint32_t *latencies_us;     // Reply latency per answered command
+  size_t    latency_count;
+  size_t    latency_capacity;
+};
+
+static struct ReplayConnection *connections;
+static size_t                   connection_count;
+static struct ReplayStats       stats;
+static uint64_t                 last_received_ns; // When the server last sent anything
+
+static int  load_capture(const char *path, struct ReplayRecord **records, size_t *record_count);
+static void apply_record(const struct ReplayRecord *record, const struct sockaddr_in *server_address, uint64_t now);
+static void queue_output(struct ReplayConnection *connection, const char *data, size_t length);
+static void flush_output(struct ReplayConnection *connection);
+static void handle_readable(struct ReplayConnection *connection);
+static void handle_line(struct ReplayConnection *connection, char *line, uint64_t now);
+static void finish_closing(struct ReplayConnection *connection);
+static void close_connection(struct ReplayConnection *connection);
+static void print_report(double elapsed_seconds, double speed);
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+  double speed = 1.0; // 0 replays as fast as possible
+  int    port  = PORT;
+  int    opt;
+  while ((opt = getopt(argc, argv, "s:mp:")) != -1) {
+    switch (opt) {
+    case 's': {
+      char *end;
+      speed = strtod(optarg, &end);
+      if (*optarg == '\0' || *end != '\0' || !(speed > 0)) {
+        fprintf(stderr, "Invalid speed: %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'm':
+      speed = 0;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Invalid port: %s\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s speed | -m] [-p port] <capture_file> <server_ip>\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    fprintf(stderr, "Usage: %s [-s speed | -m] [-p port] <capture_file> <server_ip>\n", argv[0]);
+    return 1;
+  }
+
+  struct sockaddr_in server_address;
+  memset(&server_address, 0, sizeof(server_address));
+  server_address.sin_family = AF_INET;
+  server_address.sin_port   = htons((uint16_t)port);
+  if (inet_pton(AF_INET, argv[optind + 1], &server_address.sin_addr) <= 0) {
+    DIE("Invalid address or address not supported");
+  }
+
+  struct ReplayRecord *records;
+  size_t               record_count;
+  if (load_capture(argv[optind], &records, &record_count) == -1) {
+    return 1;
+  }
+  printf("Loaded %zu records for %zu connections from %s\n", record_count, connection_count, argv[optind]);
+
+  struct pollfd *poll_fds = malloc(sizeof(struct pollfd) * (connection_count + 1));
+  int           *poll_map = malloc(sizeof(int) * (connection_count + 1));
+  if (poll_fds == NULL || poll_map == NULL) {
+    DIE("malloc");
+  }
+
+  uint64_t start_ns    = now_ns();
+  uint64_t drain_start = 0;
+  size_t   next_record = 0;
+  while (1) {
+    uint64_t now = now_ns();
+    while (next_record < record_count &&
+           (speed == 0 || start_ns + (uint64_t)(records[next_record].timestamp_us * 1000 / speed) <= now)) {
+      apply_record(&records[next_record++], &server_address, now);
+    }
+
+    int timeout_ms = 0;
+    if (next_record < record_count) {
+      if (speed > 0) {
+        uint64_t due = start_ns + (uint64_t)(records[next_record].timestamp_us * 1000 / speed);
+        timeout_ms   = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+      }
+    } else {
+      if (drain_start == 0) {
+        drain_start = now;
+      }
+      uint64_t drain_deadline = (last_received_ns > drain_start ? last_received_ns : drain_start) +
+                                (uint64_t)REPLAY_DRAIN_SECONDS * 1000000000;
+
+      // Done once every command was answered and every captured close went through
+      int is_idle = 1;
+      for (size_t i = 0; i < connection_count && is_idle; i++) {
+        if (connections[i].socket_fd != -1 &&
+            (connections[i].output_length > 0 || connections[i].pending_count > 0 || connections[i].is_closing)) {
+          is_idle = 0;
+        }
+      }
+      if (is_idle || now >= drain_deadline) {
+        break;
+      }
+      timeout_ms = 100;
+    }
+
+    nfds_t poll_count = 0;
+    for (size_t i = 0; i < connection_count; i++) {
+      if (connections[i].socket_fd == -1) {
+        continue;
+      }
+      poll_fds[poll_count].fd      = connections[i].socket_fd;
+      poll_fds[poll_count].events  = POLLIN | (connections[i].output_length > 0 ? POLLOUT : 0);
+      poll_fds[poll_count].revents = 0;
+      poll_map[poll_count++]       = (int)i;
+    }
+
+    if (poll(poll_fds, poll_count, timeout_ms) == -1) {
+      if (errno != EINTR) {
+        DIE("poll");
+      }
+      continue;
+    }
+
+    for (nfds_t i = 0; i < poll_count; i++) {
+      struct ReplayConnection *connection = &connections[poll_map[i]];
+      if (poll_fds[i].revents & POLLOUT) {
+        flush_output(connection);
+      }
+      if (connection->socket_fd != -1 && (poll_fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        handle_readable(connection);
+      }
+    }
+  }
+
+  double elapsed_seconds = (double)(now_ns() - start_ns) / 1e9;
+  for (size_t i = 0; i < connection_count; i++) {
+    close_connection(&connections[i]);
+  }
+  print_report(elapsed_seconds, speed);
+  return 0;
+}
+
+static int   *connection_lookup; // Open-addressed capture ID -> connection index, -1 marks a free slot
+static size_t connection_lookup_size;
+
+static size_t lookup_slot(uint64_t capture_id)
+{
+  size_t slot = (size_t)(capture_id * 0x9E3779B97F4A7C15ull) & (connection_lookup_size - 1);
+  while (connection_lookup[slot] != -1 && connections[connection_lookup[slot]].capture_id != capture_id) {
+    slot = (slot + 1) & (connection_lookup_size - 1);
+  }
+  return slot;
+}
+
+static int find_connection(uint64_t capture_id)
+{
+  return connection_lookup_size > 0 ? connection_lookup[lookup_slot(capture_id)] : -1;
+}
+
+static void add_connection_lookup(int connection)
+{
+  // Keep the table at most half full, rebuilding it from the connections array on growth
+  if ((size_t)(connection + 1) * 2 > connection_lookup_size) {
+    connection_lookup_size = connection_lookup_size > 0 ? connection_lookup_size * 2 : 128;
+    free(connection_lookup);
+    if ((connection_lookup = malloc(sizeof(int) * connection_lookup_size)) == NULL) {
+      DIE("malloc");
+    }
+    memset(connection_lookup, 0xff, sizeof(int) * connection_lookup_size);
+    for (int i = 0; i < connection; i++) {
+      connection_lookup[lookup_slot(connections[i].capture_id)] = i;
+    }
+  }
+  connection_lookup[lookup_slot(connections[connection].capture_id)] = connection;
+}
+
+// Reads the whole capture up front so file I/O never disturbs the replay timing
+static int load_capture(const char *path, struct ReplayRecord **records, size_t *record_count)
+{
+  struct CaptureReader reader;
+  if (capture_reader_open(&reader, path) == -1) {
+    fprintf(stderr, "Could not open capture %s\n", path);
+    return -1;
+  }
+
+  struct CaptureRecord record;
+  size_t               capacity            = 0;
+  size_t               connection_capacity = 0;
+  int                  result;
+  *records      = NULL;
+  *record_count = 0;
+  while ((result = capture_reader_next(&reader, &record)) == 1) {
+    int connection = find_connection(record.connection_id);
+    if (record.event == CAPTURE_OPEN) {
+      if (connection_count == connection_capacity) {
+        connection_capacity = connection_capacity > 0 ? connection_capacity * 2 : 64;
+        connections         = realloc(connections, sizeof(struct ReplayConnection) * connection_capacity);
+        if (connections == NULL) {
+          DIE("realloc");
+        }
+      }
+      memset(&connections[connection_count], 0, sizeof(struct ReplayConnection));
+      connections[connection_count].capture_id = record.connection_id;
+      connections[connection_count].socket_fd  = -1;
+      connection                               = (int)connection_count++;
+      add_connection_lookup(connection);
+    } else if (connection == -1) {
+      continue; // Connection opened before the capture started
+    }
+
+    if (*record_count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 1024;
+      *records = realloc(*records, sizeof(struct ReplayRecord) * capacity);
+      if (*records == NULL) {
+        DIE("realloc");
+      }
+    }
+
+    struct ReplayRecord *replay_record = &(*records)[(*record_count)++];
+    replay_record->event               = record.event;
+    replay_record->timestamp_us        = record.timestamp_us;
+    replay_record->connection          = connection;
+    replay_record->length              = record.length;
+    replay_record->data                = NULL;
+    if (record.event == CAPTURE_DATA) {
+      if ((replay_record->data = malloc(record.length)) == NULL) {
+        DIE("malloc");
+      }
+      memcpy(replay_record->data, record.data, record.length);
+    }
+  }
+  capture_reader_close(&reader);
+
+  if (result == -1) {
+    fprintf(stderr, "Capture %s is truncated or malformed, replaying the first %zu records\n", path, *record_count);
+  }
+  return 0;
+}
+
+static void push_pending(struct ReplayConnection *connection, struct PendingReply pending)
+{
+  if (connection->pending_head + connection->pending_count == connection->pending_capacity) {
+    if (connection->pending_head > 0) {
+      memmove(
+          connection->pending, connection->pending + connection->pending_head,
+          sizeof(struct PendingReply) * connection->pending_count
+      );
+      connection->pending_head = 0;
+    } else {
+      connection->pending_capacity = connection->pending_capacity > 0 ? connection->pending_capacity * 2 : 16;
+      connection->pending = realloc(connection->pending, sizeof(struct PendingReply) * connection->pending_capacity);
+      if (connection->pending == NULL) {
+        DIE("realloc");
+      }
+    }
+  }
+  connection->pending[connection->pending_head + connection->pending_count++] = pending;
+}
+
+static void apply_record(const struct ReplayRecord *record, const struct sockaddr_in *server_address, uint64_t now)
+{
+  struct ReplayConnection *connection = &connections[record->connection];
+
+  switch (record->event) {
+  case CAPTURE_OPEN: {
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1 || connect(socket_fd, (const struct sockaddr *)server_address, sizeof(*server_address)) == -1) {
+      perror("connect");
+      if (socket_fd != -1) {
+        close(socket_fd);
+      }
+      stats.connect_failures++;
+      return;
+    }
+
+    // Commands are small and latency is what is being measured, so do not let Nagle hold them back
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK);
+    connection->socket_fd = socket_fd;
+    strcpy(connection->username, "Anonymous");
+    break;
+  }
+  case CAPTURE_DATA: {
+    if (connection->socket_fd == -1 || connection->is_closing) {
+      return;
+    }
+
+    queue_output(connection, record->data, record->length);
+    queue_output(connection, "\n", 1);
+    stats.commands_sent++;
+
+    // Mirror the server's tokenizing to know which line will answer the command
+    const char *verb = record->data;
+    const char *end  = record->data + record->length;
+    while (verb < end && *verb == ' ') {
+      verb++;
+    }
+    size_t verb_length = 0;
+    while (verb + verb_length < end && verb[verb_length] != ' ') {
+      verb_length++;
+    }
+
+    struct PendingReply pending = {now, EXPECT_REPLY, NULL, 0};
+    if (verb_length == 0 || (verb_length == 4 && memcmp(verb, "PONG", 4) == 0) ||
+        (verb_length == 4 && memcmp(verb, "QUIT", 4) == 0)) {
+      return; // Never answered
+    }
+    if (verb_length == 3 && memcmp(verb, "MSG", 3) == 0) {
+      const char *payload = verb + verb_length;
+      for (int i = 0; i < 2 && payload < end && *payload == ' '; i++) {
+        payload++;
+      }
+      pending.expectation    = EXPECT_MESSAGE;
+      pending.payload        = payload;
+      pending.payload_length = (size_t)(end - payload);
+    }
+    push_pending(connection, pending);
+    break;
+  }
+  case CAPTURE_CLOSE:
+    if (connection->socket_fd == -1) {
+      return;
+    }
+    connection->is_closing = 1;
+    finish_closing(connection);
+    break;
+  }
+}
+
+static void queue_output(struct ReplayConnection *connection, const char *data, size_t length)
+{
+  if (connection->output_length + length > connection->output_capacity) {
+    size_t capacity = connection->output_capacity > 0 ? connection->output_capacity : MAX_BUFFER_SIZE;
+    while (capacity < connection->output_length + length) {
+      capacity *= 2;
+    }
+    if ((connection->output = realloc(connection->output, capacity)) == NULL) {
+      DIE("realloc");
+    }
+    connection->output_capacity = capacity;
+  }
+
+  memcpy(connection->output + connection->output_length, data, length);
+  connection->output_length += length;
+}
+
+static void flush_output(struct ReplayConnection *connection)
+{
+  size_t written = 0;
+  while (written < connection->output_length) {
+    ssize_t bytes_sent =
+        send(connection->socket_fd, connection->output + written, connection->output_length - written, 0);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("send");
+        close_connection(connection);
+        return;
+      }
+      break;
+    }
+    written += (size_t)bytes_sent;
+  }
+
+  memmove(connection->output, connection->output + written, connection->output_length - written);
+  connection->output_length -= written;
+  finish_closing(connection);
+}
+
+// Hangs up a connection the capture closed once everything sent to it has been answered, so replaying faster
+// than recorded does not cut replies off
+static void finish_closing(struct ReplayConnection *connection)
+{
+  if (connection->is_closing && !connection->is_shut_down && connection->output_length == 0 &&
+      connection->pending_count == 0) {
+    shutdown(connection->socket_fd, SHUT_WR); // The server closes its side once it reads EOF
+    connection->is_shut_down = 1;
+  }
+}
+
+static void handle_readable(struct ReplayConnection *connection)
+{
+  ssize_t bytes_received = recv(
+      connection->socket_fd, connection->input + connection->input_length,
+      sizeof(connection->input) - 1 - connection->input_length, 0
+  );
+  if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (bytes_received <= 0) {
+    close_connection(connection);
+    return;
+  }
+
+  uint64_t now = now_ns();
+  last_received_ns = now;
+  connection->input_length += (size_t)bytes_received;
+
+  char *line = connection->input;
+  char *newline;
+  while ((newline = memchr(line, '\n', connection->input_length - (size_t)(line - connection->input))) != NULL) {
+    *newline = '\0';
+    handle_line(connection, line, now);
+    line = newline + 1;
+  }
+
+  connection->input_length -= (size_t)(line - connection->input);
+  memmove(connection->input, line, connection->input_length);
+  if (connection->input_length == sizeof(connection->input) - 1) {
+    connection->input[connection->input_length] = '\0'; // Longer than the buffer, treat what fits as a line
+    handle_line(connection, connection->input, now);
+    connection->input_length = 0;
+  }
+}
+
+static void record_latency(uint64_t latency_ns)
+{
+  if (stats.latency_count == stats.latency_capacity) {
+    stats.latency_capacity = stats.latency_capacity > 0 ? stats.latency_capacity * 2 : 4096;
+    stats.latencies_us     = realloc(stats.latencies_us, sizeof(uint32_t) * stats.latency_capacity);
+    if (stats.latencies_us == NULL) {
+      DIE("realloc");
+    }
+  }
+  stats.latencies_us[stats.latency_count++] = (uint32_t)(latency_ns / 1000);
+}
+
+static void handle_line(struct ReplayConnection *connection, char *line, uint64_t now)
+{
+  stats.lines_received++;
+
+  if (strcmp(line, "PING") == 0) {
+    queue_output(connection, "PONG\n", 5);
+    flush_output(connection);
+    return;
+  }
+
+  if (strncmp(line, "INFO Welcome!", 13) == 0) {
+    return; // Sent on connect, not in reply to a command
+  }
+  if (strncmp(line, "SEARCHHIT ", 10) == 0) {
+    return; // Follows the SEARCHRESULT line that answers the command
+  }
+
+  struct PendingReply *head = connection->pending_count > 0 ? &connection->pending[connection->pending_head] : NULL;
+  if (strncmp(line, "MSG ", 4) == 0) {
+    stats.deliveries++;
+
+    // The server formats broadcasts into MAX_BUFFER_SIZE bytes, a longer one arrives cut off and without its newline,
+    // which is also where handle_readable splits it off. Its payload then only has to be a prefix of the sent one
+    int is_truncated = strlen(line) == MAX_BUFFER_SIZE - 1;
+
+    // MSG <guild_id> <channel_id> <username> <payload>, only the sender's own echo answers its command
+    char *saveptr;
+    strtok_r(line, " ", &saveptr);
+    strtok_r(NULL, " ", &saveptr);
+    strtok_r(NULL, " ", &saveptr);
+    char  *username       = strtok_r(NULL, " ", &saveptr);
+    char  *payload        = saveptr != NULL ? saveptr : "";
+    size_t payload_length = strlen(payload);
+    if (head == NULL || head->expectation != EXPECT_MESSAGE || username == NULL ||
+        strcmp(username, connection->username) != 0 ||
+        !(payload_length == head->payload_length || (is_truncated && payload_length < head->payload_length)) ||
+        memcmp(payload, head->payload, payload_length) != 0) {
+      return;
+    }
+  } else {
+    const char *prefix = "INFO Username set to ";
+    if (strncmp(line, prefix, strlen(prefix)) == 0) {
+      // Only the final '.' ends the sentence, the name itself may contain dots
+      const char *name        = line + strlen(prefix);
+      size_t      name_length = strlen(name);
+      if (name_length > 0 && name[name_length - 1] == '.') {
+        name_length--;
+      }
+      if (name_length > MAX_USERNAME_SIZE - 1) {
+        name_length = MAX_USERNAME_SIZE - 1;
+      }
+      memcpy(connection->username, name, name_length);
+      connection->username[name_length] = '\0';
+    }
+    if (head == NULL) {
+      stats.unmatched++;
+      return;
+    }
+  }
+
+  record_latency(now - head->sent_ns);
+  connection->pending_head++;
+  connection->pending_count--;
+  finish_closing(connection);
+}
+
+static void close_connection(struct ReplayConnection *connection)
+{
+  if (connection->socket_fd == -1) {
+    return;
+  }
+
+  close(connection->socket_fd);
+  connection->socket_fd = -1;
+  stats.unanswered += connection->pending_count;
+  connection->pending_count = 0;
+  connection->output_length = 0;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+  uint32_t left  = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+  return (left > right) - (left < right);
+}
+
+static uint32_t percentile(double fraction)
+{
+  size_t index = (size_t)(fraction * (double)stats.latency_count);
+  if (index >= stats.latency_count) {
+    index = stats.latency_count - 1;
+  }
+  return stats.latencies_us[index];
+}
+
+static void print_report(double elapsed_seconds, double speed)
+{
+  if (speed > 0) {
+    printf(
+        "Replayed %zu connections and %llu commands in %.2f s at %gx speed\n", connection_count,
+        (unsigned long long)stats.commands_sent, elapsed_seconds, speed
+    );
+  } else {
+    printf(
+        "Replayed %zu connections and %llu commands in %.2f s as fast as possible\n", connection_count,
+        (unsigned long long)stats.commands_sent, elapsed_seconds
+    );
+  }
+  printf(
+      "Throughput: %.1f commands/s sent, %.1f lines/s received\n", (double)stats.commands_sent / elapsed_seconds,
+      (double)stats.lines_received / elapsed_seconds
+  );
+
+  if (stats.latency_count > 0) {
+    qsort(stats.latencies_us, stats.latency_count, sizeof(uint32_t), compare_latency);
+
+    double total = 0;
+    for (size_t i = 0; i < stats.latency_count; i++) {
+      total += stats.latencies_us[i];
+    }
+    printf(
+        "Latency over %zu replies (us): mean %.0f, p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n", stats.latency_count,
+        total / (double)stats.latency_count, percentile(0.50), percentile(0.90), percentile(0.99), percentile(0.999),
+        stats.latencies_us[stats.latency_count - 1]
+    );
+  } else {
+    printf("Latency: no replies received\n");
+  }
+
+  printf(
+      "Broadcast lines received: %llu, unmatched replies: %llu, unanswered commands: %llu, failed connections: %llu\n",
+      (unsigned long long)stats.deliveries, (unsigned long long)stats.unmatched,
+      (unsigned long long)stats.unanswered, (unsigned long long)stats.connect_failures
+  );
+}
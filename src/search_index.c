@@ -0,0 +1,961 @@
+#include "search_index.h"
+
+#include <limits.h>
+#include <sys/mman.h>
+
+#define SEARCH_SEGMENT_MAGIC "CHATIDX1"
+#define SEARCH_SEGMENT_MAGIC_LENGTH 8
+#define SEARCH_MEMTABLE_INITIAL_TERMS 256
+
+/*
+ * Segment file layout, all integers in host byte order since segments never outlive the process:
+ *   header | document offsets (document_count + 1 u32) | term entries | documents | term bytes | postings
+ * A document is varint channel ID, varint username length, username, varint text length, text. Postings hold
+ * segment-local document IDs in ascending order, the first as is and the rest as varint deltas.
+ */
+struct SearchSegmentHeader
+{
+  char     magic[SEARCH_SEGMENT_MAGIC_LENGTH];
+  uint32_t first_document;
+  uint32_t document_count;
+  uint32_t term_count;
+  uint32_t reserved;
+  uint64_t documents_length;
+  uint64_t terms_length;
+  uint64_t postings_length;
+};
+
+struct SearchSegmentTerm
+{
+  uint32_t term_offset;     // Into the term bytes
+  uint32_t term_length;     // Bytes in the term
+  uint32_t postings_offset; // Into the postings
+  uint32_t postings_length; // Bytes of encoded postings
+};
+
+struct SearchSegment
+{
+  void                           *map;              // Read-only mapping of the whole file
+  size_t                          map_size;         // Bytes mapped
+  uint32_t                        first_document;   // ID of the segment's first document
+  uint32_t                        document_count;   // Documents in the segment, their IDs are consecutive
+  uint32_t                        term_count;       // Entries in term_entries
+  const uint32_t                 *document_offsets; // document_count + 1 offsets into documents
+  const struct SearchSegmentTerm *term_entries;     // Sorted by term bytes
+  const uint8_t                  *documents;
+  const char                     *terms;
+  const uint8_t                  *postings;
+};
+
+struct ByteBuffer
+{
+  uint8_t *data;
+  size_t   length;
+  size_t   capacity;
+};
+
+struct MemTerm
+{
+  char             *term;          // NULL for a free hash table slot
+  uint32_t          length;        // Bytes in term
+  uint32_t          hash;          // Hash of term
+  uint32_t          last_document; // Memtable-local ID of the last document in postings
+  struct ByteBuffer postings;      // Encoded like segment postings
+};
+
+struct SearchMemTable
+{
+  uint32_t          first_document;   // ID of the memtable's first document
+  uint32_t          document_count;   // Documents added so far
+  struct ByteBuffer documents;        // Encoded like segment documents
+  struct ByteBuffer document_offsets; // document_count + 1 u32 offsets into documents
+  struct MemTerm   *terms;            // Open-addressed hash table
+  uint32_t          term_count;       // Used slots in terms
+  uint32_t          term_capacity;    // Slots in terms, a power of two
+};
+
+// Uniform read access to a memtable or a segment
+struct SearchSource
+{
+  uint32_t                     first_document;
+  uint32_t                     document_count;
+  const uint8_t               *documents;
+  const uint32_t              *document_offsets;
+  const struct SearchMemTable *memtable; // Set for a memtable
+  const struct SearchSegment  *segment;  // Set for a segment
+};
+
+// A term with its postings, as walked while merging
+struct MergeTerm
+{
+  const char    *term;
+  uint32_t       length;
+  const uint8_t *postings;
+  uint32_t       postings_length;
+};
+
+static void *indexer_thread(void *arg);
+
+static int buffer_reserve(struct ByteBuffer *buffer, size_t extra)
+{
+  if (buffer->length + extra <= buffer->capacity) {
+    return 0;
+  }
+
+  size_t capacity = buffer->capacity > 0 ? buffer->capacity : 64;
+  while (capacity < buffer->length + extra) {
+    capacity *= 2;
+  }
+  uint8_t *data = realloc(buffer->data, capacity);
+  if (data == NULL) {
+    return -1;
+  }
+  buffer->data     = data;
+  buffer->capacity = capacity;
+  return 0;
+}
+
+static int buffer_append(struct ByteBuffer *buffer, const void *data, size_t length)
+{
+  if (buffer_reserve(buffer, length) == -1) {
+    return -1;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return 0;
+}
+
+static int buffer_append_u32(struct ByteBuffer *buffer, uint32_t value)
+{
+  return buffer_append(buffer, &value, sizeof(value));
+}
+
+static int buffer_append_varint(struct ByteBuffer *buffer, uint32_t value)
+{
+  uint8_t bytes[5];
+  size_t  length = 0;
+  while (value >= 0x80) {
+    bytes[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[length++] = (uint8_t)value;
+  return buffer_append(buffer, bytes, length);
+}
+
+static int read_varint(const uint8_t **cursor, const uint8_t *end, uint32_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 35 && *cursor < end; shift += 7) {
+    uint8_t byte = *(*cursor)++;
+    *value |= (uint32_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return 0;
+    }
+  }
+  return -1; // Truncated or longer than any 32-bit value
+}
+
+static uint32_t hash_term(const char *term, uint32_t length)
+{
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (uint32_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)term[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int compare_terms(const char *a, uint32_t a_length, const char *b, uint32_t b_length)
+{
+  int order = memcmp(a, b, a_length < b_length ? a_length : b_length);
+  if (order != 0) {
+    return order;
+  }
+  return (a_length > b_length) - (a_length < b_length);
+}
+
+// Letters, digits and any non-ASCII byte, so words in UTF-8 text stay whole
+static int is_term_byte(unsigned char byte)
+{
+  return (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || (byte >= '0' && byte <= '9') || byte >= 0x80;
+}
+
+// Stores the next lowercased term of [*cursor, end) in term, returns 0 once the text is exhausted
+static int next_term(const char **cursor, const char *end, char *term, uint32_t *length)
+{
+  const char *position = *cursor;
+  while (position < end && !is_term_byte((unsigned char)*position)) {
+    position++;
+  }
+  if (position == end) {
+    *cursor = position;
+    return 0;
+  }
+
+  *length = 0;
+  for (; position < end && is_term_byte((unsigned char)*position); position++) {
+    if (*length < SEARCH_MAX_TERM_LENGTH) {
+      char byte         = *position;
+      term[(*length)++] = byte >= 'A' && byte <= 'Z' ? (char)(byte - 'A' + 'a') : byte;
+    }
+  }
+  *cursor = position;
+  return 1;
+}
+
+static struct SearchMemTable *memtable_create(uint32_t first_document)
+{
+  struct SearchMemTable *memtable = calloc(1, sizeof(struct SearchMemTable));
+  if (memtable == NULL) {
+    return NULL;
+  }
+
+  memtable->first_document = first_document;
+  memtable->term_capacity  = SEARCH_MEMTABLE_INITIAL_TERMS;
+  memtable->terms          = calloc(memtable->term_capacity, sizeof(struct MemTerm));
+  if (memtable->terms == NULL || buffer_append_u32(&memtable->document_offsets, 0) == -1) {
+    free(memtable->terms);
+    free(memtable);
+    return NULL;
+  }
+  return memtable;
+}
+
+static void memtable_free(struct SearchMemTable *memtable)
+{
+  for (uint32_t i = 0; i < memtable->term_capacity; i++) {
+    free(memtable->terms[i].term);
+    free(memtable->terms[i].postings.data);
+  }
+  free(memtable->terms);
+  free(memtable->documents.data);
+  free(memtable->document_offsets.data);
+  free(memtable);
+}
+
+static struct MemTerm *
+memtable_slot(const struct SearchMemTable *memtable, const char *term, uint32_t length, uint32_t hash)
+{
+  uint32_t mask = memtable->term_capacity - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    struct MemTerm *entry = &memtable->terms[slot];
+    if (entry->term == NULL ||
+        (entry->hash == hash && entry->length == length && memcmp(entry->term, term, length) == 0)) {
+      return entry;
+    }
+  }
+}
+
+// Keeps the hash table at most half full
+static int memtable_reserve_term(struct SearchMemTable *memtable)
+{
+  if ((memtable->term_count + 1) * 2 <= memtable->term_capacity) {
+    return 0;
+  }
+
+  struct SearchMemTable grown = *memtable;
+  grown.term_capacity         = memtable->term_capacity * 2;
+  grown.terms                 = calloc(grown.term_capacity, sizeof(struct MemTerm));
+  if (grown.terms == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < memtable->term_capacity; i++) {
+    struct MemTerm *entry = &memtable->terms[i];
+    if (entry->term != NULL) {
+      *memtable_slot(&grown, entry->term, entry->length, entry->hash) = *entry;
+    }
+  }
+
+  free(memtable->terms);
+  memtable->terms         = grown.terms;
+  memtable->term_capacity = grown.term_capacity;
+  return 0;
+}
+
+static int memtable_add(struct SearchMemTable *memtable, int channel_id, const char *username, const char *text)
+{
+  size_t username_length  = strlen(username);
+  size_t text_length      = strlen(text);
+  size_t documents_length = memtable->documents.length;
+  if (buffer_append_varint(&memtable->documents, (uint32_t)channel_id) == -1 ||
+      buffer_append_varint(&memtable->documents, (uint32_t)username_length) == -1 ||
+      buffer_append(&memtable->documents, username, username_length) == -1 ||
+      buffer_append_varint(&memtable->documents, (uint32_t)text_length) == -1 ||
+      buffer_append(&memtable->documents, text, text_length) == -1 ||
+      buffer_append_u32(&memtable->document_offsets, (uint32_t)memtable->documents.length) == -1) {
+    memtable->documents.length = documents_length;
+    return -1;
+  }
+  uint32_t document = memtable->document_count++;
+
+  // A term that cannot be recorded only makes this document harder to find, so carry on with the rest
+  const char *cursor = text;
+  char        term[SEARCH_MAX_TERM_LENGTH];
+  uint32_t    length;
+  while (next_term(&cursor, text + text_length, term, &length)) {
+    if (memtable_reserve_term(memtable) == -1) {
+      perror("search index");
+      continue;
+    }
+
+    uint32_t        hash  = hash_term(term, length);
+    struct MemTerm *entry = memtable_slot(memtable, term, length, hash);
+    if (entry->term == NULL) {
+      if ((entry->term = malloc(length)) == NULL) {
+        perror("search index");
+        continue;
+      }
+      memcpy(entry->term, term, length);
+      entry->length = length;
+      entry->hash   = hash;
+      memtable->term_count++;
+    } else if (entry->postings.length > 0 && entry->last_document == document) {
+      continue; // Repeated within the document
+    }
+
+    uint32_t delta = entry->postings.length > 0 ? document - entry->last_document : document;
+    if (buffer_append_varint(&entry->postings, delta) == -1) {
+      perror("search index");
+      continue;
+    }
+    entry->last_document = document;
+  }
+  return 0;
+}
+
+static void segment_free(struct SearchSegment *segment)
+{
+  munmap(segment->map, segment->map_size);
+  free(segment);
+}
+
+static void source_from_memtable(struct SearchSource *source, const struct SearchMemTable *memtable)
+{
+  source->first_document   = memtable->first_document;
+  source->document_count   = memtable->document_count;
+  source->documents        = memtable->documents.data;
+  source->document_offsets = (const uint32_t *)memtable->document_offsets.data;
+  source->memtable         = memtable;
+  source->segment          = NULL;
+}
+
+static void source_from_segment(struct SearchSource *source, const struct SearchSegment *segment)
+{
+  source->first_document   = segment->first_document;
+  source->document_count   = segment->document_count;
+  source->documents        = segment->documents;
+  source->document_offsets = segment->document_offsets;
+  source->memtable         = NULL;
+  source->segment          = segment;
+}
+
+// Returns 0 and the term's encoded postings, or -1 if no document in the source contains the term
+static int source_find_postings(
+    const struct SearchSource *source, const char *term, uint32_t length, const uint8_t **postings,
+    uint32_t *postings_length
+)
+{
+  if (source->memtable != NULL) {
+    const struct MemTerm *entry = memtable_slot(source->memtable, term, length, hash_term(term, length));
+    if (entry->term == NULL) {
+      return -1;
+    }
+    *postings        = entry->postings.data;
+    *postings_length = (uint32_t)entry->postings.length;
+    return 0;
+  }
+
+  const struct SearchSegment *segment = source->segment;
+  uint32_t                    low     = 0;
+  uint32_t                    high    = segment->term_count;
+  while (low < high) {
+    uint32_t                        middle = low + (high - low) / 2;
+    const struct SearchSegmentTerm *entry  = &segment->term_entries[middle];
+    int order = compare_terms(segment->terms + entry->term_offset, entry->term_length, term, length);
+    if (order == 0) {
+      *postings        = segment->postings + entry->postings_offset;
+      *postings_length = entry->postings_length;
+      return 0;
+    }
+    if (order < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return -1;
+}
+
+static int source_document(const struct SearchSource *source, uint32_t document, struct SearchHit *hit)
+{
+  const uint8_t *cursor = source->documents + source->document_offsets[document];
+  const uint8_t *end    = source->documents + source->document_offsets[document + 1];
+  uint32_t       channel_id, username_length, text_length;
+
+  if (read_varint(&cursor, end, &channel_id) == -1 || read_varint(&cursor, end, &username_length) == -1 ||
+      username_length > (size_t)(end - cursor)) {
+    return -1;
+  }
+  hit->username        = (const char *)cursor;
+  hit->username_length = (int)username_length;
+  cursor += username_length;
+  if (read_varint(&cursor, end, &text_length) == -1 || text_length > (size_t)(end - cursor)) {
+    return -1;
+  }
+  hit->text        = (const char *)cursor;
+  hit->text_length = (int)text_length;
+  hit->channel_id  = (int)channel_id;
+  hit->document    = source->first_document + document;
+  return 0;
+}
+
+// Decodes postings into a new array of source-local document IDs, every entry takes at least one byte
+static uint32_t *decode_postings(const uint8_t *postings, uint32_t postings_length, uint32_t *count)
+{
+  uint32_t *documents = malloc(sizeof(uint32_t) * (postings_length > 0 ? postings_length : 1));
+  if (documents == NULL) {
+    return NULL;
+  }
+
+  const uint8_t *cursor = postings;
+  uint32_t       value;
+  *count = 0;
+  while (cursor < postings + postings_length && read_varint(&cursor, postings + postings_length, &value) == 0) {
+    documents[*count] = *count > 0 ? documents[*count - 1] + value : value;
+    (*count)++;
+  }
+  return documents;
+}
+
+int search_indexer_start(struct SearchIndexer *indexer, const char *directory)
+{
+  indexer->directory = directory;
+  if (access(directory, W_OK | X_OK) == -1 || mpsc_queue_init(&indexer->queue) == -1) {
+    return -1;
+  }
+  if (pthread_create(&indexer->thread, NULL, indexer_thread, indexer) != 0) {
+    return -1;
+  }
+  pthread_detach(indexer->thread);
+  return 0;
+}
+
+void search_index_init(struct SearchIndex *index, struct SearchIndexer *indexer)
+{
+  memset(index, 0, sizeof(*index));
+  index->indexer   = indexer;
+  index->job.index = index;
+  atomic_init(&index->is_job_done, 0);
+}
+
+static uint32_t retain_from(const struct SearchIndex *index)
+{
+  return index->next_document > SEARCH_RETAINED_MESSAGES ? index->next_document - SEARCH_RETAINED_MESSAGES : 0;
+}
+
+// Swaps in the result of a finished job, on failure its inputs stay in place and are retried once another
+// memtable's worth of messages arrived, so e.g. a full disk is not hit again for every message
+static void apply_finished_job(struct SearchIndex *index)
+{
+  if (!index->is_job_running || !atomic_load_explicit(&index->is_job_done, memory_order_acquire)) {
+    return;
+  }
+
+  struct SearchIndexJob *job = &index->job;
+  if (job->result == NULL) {
+    fprintf(
+        stderr, "Search index segment could not be written, retrying after %d more messages\n",
+        SEARCH_MEMTABLE_DOCUMENTS
+    );
+    index->retry_after = index->next_document + SEARCH_MEMTABLE_DOCUMENTS;
+  } else if (job->memtable_count > 0) {
+    for (int i = 0; i < job->memtable_count; i++) {
+      memtable_free(job->memtables[i]);
+    }
+    index->frozen_count -= job->memtable_count;
+    memmove(index->frozen, index->frozen + job->memtable_count, sizeof(index->frozen[0]) * index->frozen_count);
+    index->segments[index->segment_count++] = job->result;
+  } else {
+    for (int i = 0; i < job->segment_count; i++) {
+      segment_free(job->segments[i]);
+    }
+    index->segments[job->segment_start] = job->result;
+    int tail_start                      = job->segment_start + job->segment_count;
+    memmove(
+        index->segments + job->segment_start + 1, index->segments + tail_start,
+        sizeof(index->segments[0]) * (index->segment_count - tail_start)
+    );
+    index->segment_count -= job->segment_count - 1;
+  }
+
+  index->is_job_running = 0;
+  atomic_store_explicit(&index->is_job_done, 0, memory_order_relaxed);
+}
+
+static void schedule_job(struct SearchIndex *index)
+{
+  if (index->is_job_running || index->next_document < index->retry_after) {
+    return;
+  }
+
+  // Segments holding only messages past retention are dropped without rewriting anything
+  uint32_t oldest = retain_from(index);
+  while (index->segment_count > 0 &&
+         index->segments[0]->first_document + index->segments[0]->document_count <= oldest) {
+    segment_free(index->segments[0]);
+    index->segment_count--;
+    memmove(index->segments, index->segments + 1, sizeof(index->segments[0]) * index->segment_count);
+  }
+
+  struct SearchIndexJob *job = &index->job;
+  job->memtable_count        = 0;
+  job->segment_count         = 0;
+  job->retain_from           = oldest;
+  job->result                = NULL;
+
+  if (index->frozen_count > 0 && index->segment_count < SEARCH_MAX_SEGMENTS) {
+    memcpy(job->memtables, index->frozen, sizeof(index->frozen[0]) * index->frozen_count);
+    job->memtable_count = index->frozen_count;
+  } else if (index->segment_count >= 2) {
+    // Merging neighbours until sizes strictly decrease from oldest to newest leaves O(log n) segments, and every
+    // message is rewritten O(log n) times
+    int start = index->segment_count > SEARCH_MAX_SEGMENTS / 2 ? index->segment_count - 2 : -1;
+    for (int i = index->segment_count - 2; i >= 0 && start == -1; i--) {
+      if (index->segments[i]->document_count <= index->segments[i + 1]->document_count) {
+        start = i;
+      }
+    }
+    if (start != -1) {
+      job->segment_start = start;
+      job->segments[0]   = index->segments[start];
+      job->segments[1]   = index->segments[start + 1];
+      job->segment_count = 2;
+    }
+  }
+
+  if (job->memtable_count + job->segment_count > 0) {
+    index->is_job_running = 1;
+    mpsc_queue_push(&index->indexer->queue, &job->node);
+  }
+}
+
+int search_index_add(struct SearchIndex *index, int channel_id, const char *username, const char *text)
+{
+  apply_finished_job(index);
+
+  if (index->active == NULL && (index->active = memtable_create(index->next_document)) == NULL) {
+    return -1;
+  }
+  if (memtable_add(index->active, channel_id, username, text) == -1) {
+    return -1;
+  }
+  index->next_document++;
+
+  // With the indexer behind, the active memtable keeps growing rather than holding up the caller
+  if (index->active->document_count >= SEARCH_MEMTABLE_DOCUMENTS && index->frozen_count < SEARCH_MAX_FROZEN) {
+    index->frozen[index->frozen_count++] = index->active;
+    index->active                        = NULL;
+  }
+  schedule_job(index);
+  return 0;
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+  uint32_t left  = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+  return (left > right) - (left < right);
+}
+
+// Finds the newest documents of one source containing every term, returns how many hits were stored
+static int query_source(
+    const struct SearchSource *source, char terms[][SEARCH_MAX_TERM_LENGTH], const uint32_t *lengths, int term_count,
+    uint32_t oldest, struct SearchHit *hits, int max_hits
+)
+{
+  const uint8_t *postings[SEARCH_MAX_QUERY_TERMS];
+  uint32_t       postings_lengths[SEARCH_MAX_QUERY_TERMS];
+  uint32_t       order[SEARCH_MAX_QUERY_TERMS][2]; // Postings length and term, to intersect the rarest term first
+  for (int i = 0; i < term_count; i++) {
+    if (source_find_postings(source, terms[i], lengths[i], &postings[i], &postings_lengths[i]) == -1) {
+      return 0;
+    }
+    order[i][0] = postings_lengths[i];
+    order[i][1] = (uint32_t)i;
+  }
+  qsort(order, (size_t)term_count, sizeof(order[0]), compare_counts);
+
+  uint32_t  match_count;
+  uint32_t *matches = decode_postings(postings[order[0][1]], postings_lengths[order[0][1]], &match_count);
+  if (matches == NULL) {
+    perror("search index");
+    return 0;
+  }
+
+  for (int i = 1; i < term_count && match_count > 0; i++) {
+    uint32_t  count;
+    uint32_t *documents = decode_postings(postings[order[i][1]], postings_lengths[order[i][1]], &count);
+    if (documents == NULL) {
+      perror("search index");
+      match_count = 0;
+      break;
+    }
+
+    uint32_t kept = 0;
+    uint32_t next = 0;
+    for (uint32_t j = 0; j < match_count; j++) {
+      while (next < count && documents[next] < matches[j]) {
+        next++;
+      }
+      if (next < count && documents[next] == matches[j]) {
+        matches[kept++] = matches[j];
+      }
+    }
+    match_count = kept;
+    free(documents);
+  }
+
+  int hit_count = 0;
+  for (uint32_t j = match_count; j > 0 && hit_count < max_hits; j--) {
+    if (source->first_document + matches[j - 1] < oldest) {
+      break;
+    }
+    if (source_document(source, matches[j - 1], &hits[hit_count]) == 0) {
+      hit_count++;
+    }
+  }
+  free(matches);
+  return hit_count;
+}
+
+/*
+ * Stores up to max_hits of the newest documents containing every term of query, newest first. Returns the number
+ * of hits, or -1 if the query has no terms.
+ */
+int search_index_query(struct SearchIndex *index, const char *query, struct SearchHit *hits, int max_hits)
+{
+  apply_finished_job(index);
+  schedule_job(index);
+
+  char        terms[SEARCH_MAX_QUERY_TERMS][SEARCH_MAX_TERM_LENGTH];
+  uint32_t    lengths[SEARCH_MAX_QUERY_TERMS];
+  int         term_count = 0;
+  const char *cursor     = query;
+  const char *end        = query + strlen(query);
+  while (term_count < SEARCH_MAX_QUERY_TERMS && next_term(&cursor, end, terms[term_count], &lengths[term_count])) {
+    int is_duplicate = 0;
+    for (int i = 0; i < term_count && !is_duplicate; i++) {
+      is_duplicate = compare_terms(terms[i], lengths[i], terms[term_count], lengths[term_count]) == 0;
+    }
+    if (!is_duplicate) {
+      term_count++;
+    }
+  }
+  if (term_count == 0) {
+    return -1;
+  }
+
+  // Newest first: the active memtable, then frozen memtables, then segments
+  struct SearchSource sources[1 + SEARCH_MAX_FROZEN + SEARCH_MAX_SEGMENTS];
+  int                 source_count = 0;
+  if (index->active != NULL) {
+    source_from_memtable(&sources[source_count++], index->active);
+  }
+  for (int i = index->frozen_count; i > 0; i--) {
+    source_from_memtable(&sources[source_count++], index->frozen[i - 1]);
+  }
+  for (int i = index->segment_count; i > 0; i--) {
+    source_from_segment(&sources[source_count++], index->segments[i - 1]);
+  }
+
+  uint32_t oldest    = retain_from(index);
+  int      hit_count = 0;
+  for (int i = 0; i < source_count && hit_count < max_hits; i++) {
+    if (sources[i].first_document + sources[i].document_count <= oldest) {
+      break;
+    }
+    hit_count += query_source(&sources[i], terms, lengths, term_count, oldest, hits + hit_count, max_hits - hit_count);
+  }
+  return hit_count;
+}
+
+static int compare_merge_terms(const void *a, const void *b)
+{
+  const struct MergeTerm *left  = a;
+  const struct MergeTerm *right = b;
+  return compare_terms(left->term, left->length, right->term, right->length);
+}
+
+// Lists a source's terms in sorted order, the caller frees the array
+static struct MergeTerm *sorted_terms(const struct SearchSource *source, uint32_t *count)
+{
+  uint32_t term_count = source->memtable != NULL ? source->memtable->term_count : source->segment->term_count;
+  struct MergeTerm *terms = malloc(sizeof(struct MergeTerm) * (term_count > 0 ? term_count : 1));
+  if (terms == NULL) {
+    return NULL;
+  }
+
+  *count = 0;
+  if (source->memtable != NULL) {
+    const struct SearchMemTable *memtable = source->memtable;
+    for (uint32_t i = 0; i < memtable->term_capacity; i++) {
+      const struct MemTerm *entry = &memtable->terms[i];
+      if (entry->term != NULL && entry->postings.length > 0) {
+        terms[(*count)++] =
+            (struct MergeTerm){entry->term, entry->length, entry->postings.data, (uint32_t)entry->postings.length};
+      }
+    }
+    qsort(terms, *count, sizeof(struct MergeTerm), compare_merge_terms);
+  } else {
+    const struct SearchSegment *segment = source->segment;
+    for (uint32_t i = 0; i < segment->term_count; i++) {
+      const struct SearchSegmentTerm *entry = &segment->term_entries[i];
+      terms[(*count)++]                     = (struct MergeTerm){
+          segment->terms + entry->term_offset, entry->term_length, segment->postings + entry->postings_offset,
+          entry->postings_length
+      };
+    }
+  }
+  return terms;
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+  const uint8_t *cursor = data;
+  while (length > 0) {
+    ssize_t written = write(fd, cursor, length);
+    if (written == -1) {
+      return -1;
+    }
+    cursor += written;
+    length -= (size_t)written;
+  }
+  return 0;
+}
+
+// Sections of a segment being built, in file order after the header
+struct SegmentBuilder
+{
+  uint32_t          first_document;
+  uint32_t          document_count;
+  uint32_t          term_count;
+  struct ByteBuffer document_offsets;
+  struct ByteBuffer term_entries;
+  struct ByteBuffer documents;
+  struct ByteBuffer terms;
+  struct ByteBuffer postings;
+};
+
+// Copies the documents from first on, the sources cover consecutive ranges so their order is kept
+static int merge_documents(struct SegmentBuilder *builder, const struct SearchSource *sources, int source_count)
+{
+  if (buffer_append_u32(&builder->document_offsets, 0) == -1) {
+    return -1;
+  }
+
+  for (int i = 0; i < source_count; i++) {
+    const struct SearchSource *source = &sources[i];
+    for (uint32_t document = 0; document < source->document_count; document++) {
+      if (source->first_document + document < builder->first_document) {
+        continue;
+      }
+
+      uint32_t offset = source->document_offsets[document];
+      uint32_t length = source->document_offsets[document + 1] - offset;
+      if (buffer_append(&builder->documents, source->documents + offset, length) == -1 ||
+          buffer_append_u32(&builder->document_offsets, (uint32_t)builder->documents.length) == -1) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Appends the postings of one source's term, rebased on the new segment and without documents before it
+static int merge_postings(
+    struct SegmentBuilder *builder, const struct SearchSource *source, const struct MergeTerm *term,
+    uint32_t *previous, int *has_previous
+)
+{
+  const uint8_t *cursor = term->postings;
+  const uint8_t *end    = term->postings + term->postings_length;
+  uint32_t       local  = 0;
+  uint32_t       value;
+  for (int is_first = 1; cursor < end && read_varint(&cursor, end, &value) == 0; is_first = 0) {
+    local             = is_first ? value : local + value;
+    uint32_t document = source->first_document + local;
+    if (document < builder->first_document) {
+      continue;
+    }
+
+    document -= builder->first_document;
+    if (buffer_append_varint(&builder->postings, *has_previous ? document - *previous : document) == -1) {
+      return -1;
+    }
+    *previous     = document;
+    *has_previous = 1;
+  }
+  return 0;
+}
+
+// Merges the sorted term lists of every source k-way
+static int merge_terms(struct SegmentBuilder *builder, const struct SearchSource *sources, int source_count)
+{
+  struct MergeTerm *source_terms[SEARCH_MAX_FROZEN + 2] = {0};
+  uint32_t          source_term_counts[SEARCH_MAX_FROZEN + 2];
+  uint32_t          positions[SEARCH_MAX_FROZEN + 2] = {0};
+  int               result                           = 0;
+
+  for (int i = 0; i < source_count && result == 0; i++) {
+    if ((source_terms[i] = sorted_terms(&sources[i], &source_term_counts[i])) == NULL) {
+      result = -1;
+    }
+  }
+
+  while (result == 0) {
+    const struct MergeTerm *smallest = NULL;
+    for (int i = 0; i < source_count; i++) {
+      if (positions[i] < source_term_counts[i] &&
+          (smallest == NULL || compare_merge_terms(&source_terms[i][positions[i]], smallest) < 0)) {
+        smallest = &source_terms[i][positions[i]];
+      }
+    }
+    if (smallest == NULL) {
+      break;
+    }
+
+    struct SearchSegmentTerm entry = {
+        (uint32_t)builder->terms.length, smallest->length, (uint32_t)builder->postings.length, 0
+    };
+    uint32_t previous     = 0;
+    int      has_previous = 0;
+    for (int i = 0; i < source_count && result == 0; i++) {
+      if (positions[i] < source_term_counts[i] && compare_merge_terms(&source_terms[i][positions[i]], smallest) == 0) {
+        result = merge_postings(builder, &sources[i], &source_terms[i][positions[i]++], &previous, &has_previous);
+      }
+    }
+
+    if (result == 0 && has_previous) { // Terms only found in documents past retention are dropped
+      entry.postings_length = (uint32_t)builder->postings.length - entry.postings_offset;
+      if (buffer_append(&builder->terms, smallest->term, smallest->length) == -1 ||
+          buffer_append(&builder->term_entries, &entry, sizeof(entry)) == -1) {
+        result = -1;
+      } else {
+        builder->term_count++;
+      }
+    }
+  }
+
+  for (int i = 0; i < source_count; i++) {
+    free(source_terms[i]);
+  }
+  return result;
+}
+
+// Writes the segment to a new file in the indexer's directory and maps it
+static struct SearchSegment *write_segment(const struct SearchIndexer *indexer, const struct SegmentBuilder *builder)
+{
+  struct SearchSegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SEARCH_SEGMENT_MAGIC, SEARCH_SEGMENT_MAGIC_LENGTH);
+  header.first_document   = builder->first_document;
+  header.document_count   = builder->document_count;
+  header.term_count       = builder->term_count;
+  header.documents_length = builder->documents.length;
+  header.terms_length     = builder->terms.length;
+  header.postings_length  = builder->postings.length;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/chat-search-XXXXXX", indexer->directory);
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror(path);
+    return NULL;
+  }
+  unlink(path); // Segments never outlive the server, the mapping keeps the data reachable
+
+  const struct ByteBuffer *sections[] = {
+      &builder->document_offsets, &builder->term_entries, &builder->documents, &builder->terms, &builder->postings
+  };
+  size_t size   = sizeof(header);
+  int    failed = write_all(fd, &header, sizeof(header)) == -1;
+  for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]) && !failed; i++) {
+    failed = write_all(fd, sections[i]->data, sections[i]->length) == -1;
+    size += sections[i]->length;
+  }
+
+  void *map = failed ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("search index");
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  struct SearchSegment *segment = malloc(sizeof(struct SearchSegment));
+  if (segment == NULL) {
+    munmap(map, size);
+    return NULL;
+  }
+
+  const uint8_t *base       = map;
+  segment->map              = map;
+  segment->map_size         = size;
+  segment->first_document   = header.first_document;
+  segment->document_count   = header.document_count;
+  segment->term_count       = header.term_count;
+  segment->document_offsets = (const uint32_t *)(base + sizeof(header));
+  segment->term_entries     = (const struct SearchSegmentTerm *)(base + sizeof(header) + builder->document_offsets.length);
+  segment->documents        = (const uint8_t *)segment->term_entries + builder->term_entries.length;
+  segment->terms            = (const char *)segment->documents + builder->documents.length;
+  segment->postings         = (const uint8_t *)segment->terms + builder->terms.length;
+  return segment;
+}
+
+// Merges the job's inputs into one segment, leaving out documents older than the job's retention point
+static struct SearchSegment *build_segment(const struct SearchIndexer *indexer, const struct SearchIndexJob *job)
+{
+  struct SearchSource sources[SEARCH_MAX_FROZEN + 2];
+  int                 source_count = 0;
+  for (int i = 0; i < job->memtable_count; i++) {
+    source_from_memtable(&sources[source_count++], job->memtables[i]);
+  }
+  for (int i = 0; i < job->segment_count; i++) {
+    source_from_segment(&sources[source_count++], job->segments[i]);
+  }
+
+  struct SegmentBuilder builder;
+  memset(&builder, 0, sizeof(builder));
+  uint32_t end           = sources[source_count - 1].first_document + sources[source_count - 1].document_count;
+  builder.first_document = sources[0].first_document;
+  if (builder.first_document < job->retain_from) {
+    builder.first_document = job->retain_from < end ? job->retain_from : end;
+  }
+  builder.document_count = end - builder.first_document;
+
+  struct SearchSegment *segment = NULL;
+  if (merge_documents(&builder, sources, source_count) == -1 || merge_terms(&builder, sources, source_count) == -1) {
+    perror("search index");
+  } else {
+    segment = write_segment(indexer, &builder);
+  }
+
+  free(builder.document_offsets.data);
+  free(builder.term_entries.data);
+  free(builder.documents.data);
+  free(builder.terms.data);
+  free(builder.postings.data);
+  return segment;
+}
+
+static void *indexer_thread(void *arg)
+{
+  struct SearchIndexer *indexer = (struct SearchIndexer *)arg;
+
+  while (1) {
+    struct SearchIndexJob *job = (struct SearchIndexJob *)mpsc_queue_pop_wait(&indexer->queue);
+    job->result                = build_segment(indexer, job);
+    atomic_store_explicit(&job->index->is_job_done, 1, memory_order_release);
+  }
+
+  return NULL;
+}
@@ -1,4 +1,19 @@
 #include "common.h"
+#include "capture.h"
+#include "mpsc_queue.h"
+#include "search_index.h"
+#include "timer_wheel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define IO_EVENT_BATCH 64
+#define IO_QUEUE_EVENT UINT32_MAX // epoll data of an I/O thread's queue eventfd, client slots use their index
 
 struct ClientInfo
 {
@@ -9,6 +24,14 @@ struct ClientInfo
   int                current_guild_id;            // Current guild ID
   int                current_channel_id;          // Current channel ID
   int                is_active;                   // Active status, 1 if the slot is in use, 0 if free
+  int                is_registered;               // 1 once the client completed the NAME handshake
+  atomic_int         awaiting_pong;               // 1 while a server-initiated PING is unanswered
+  unsigned long      connected_at;                // Timer tick the connection was accepted at
+  atomic_ulong       last_activity;               // Timer tick data was last received at
+  unsigned long      ping_sent_at;                // Timer tick the outstanding PING was sent at
+  struct Timer       timer;                       // Handshake, idle and PONG deadline timer
+  unsigned int       generation;                  // Incremented every time the slot is handed to a new connection
+  int                io_thread;                   // I/O thread that owns the socket
 };
 
 struct Channel
@@ -19,37 +42,299 @@ struct Channel
 
 struct Guild
 {
-  int            id;
-  char           name[MAX_NAME_LENGTH];
-  int            channel_count;
-  struct Channel channels[MAX_CHANNELS_PER_GUILD];
+  int                id;
+  char               name[MAX_NAME_LENGTH];
+  int                channel_count;
+  struct Channel     channels[MAX_CHANNELS_PER_GUILD];
+  struct SearchIndex index; // Messages sent in the guild, only the owning worker touches it
+};
+
+// Formatted once and shared by every recipient of a broadcast
+struct OutMessage
+{
+  atomic_int refs;
+  size_t     length;
+  char       data[];
+};
+
+enum ReplyKind
+{
+  REPLY_ATTACH,       // Start serving a freshly accepted connection
+  REPLY_MESSAGE,      // Write a message to the connection
+  REPLY_DISCONNECT,   // Flush what can be written and close the connection
+  REPLY_COMMAND_DONE, // A command dispatched for the connection finished executing
+  REPLY_BROADCAST,    // Write a message to several connections, sent as a struct BroadcastReply
+};
+
+// Sent to the I/O thread owning a connection
+struct Reply
+{
+  struct MpscNode    node;         // I/O thread queue membership, must stay first
+  enum ReplyKind     kind;         // What the I/O thread should do
+  int                client_index; // Target client slot
+  unsigned int       generation;   // Slot generation when queued, stale replies are dropped
+  int                route_worker; // REPLY_COMMAND_DONE: worker owning the client's guild afterwards
+  struct OutMessage *message;      // REPLY_MESSAGE: payload, released once written or buffered
+};
+
+// A client slot as it was when a broadcast was addressed, dropped by the I/O thread if the slot was reused since
+struct Recipient
+{
+  int          client_index;
+  unsigned int generation;
+};
+
+// One broadcast for all of its recipients owned by the same I/O thread
+struct BroadcastReply
+{
+  struct Reply     reply;           // kind is REPLY_BROADCAST, client_index and generation are unused, must stay first
+  int              recipient_count; // Entries used in recipients
+  struct Recipient recipients[];    // Recipients in the order they are written to
+};
+
+// Sent from an I/O thread to a worker
+struct Command
+{
+  struct Reply    done;         // Completion, allocated up front so reporting it back cannot fail, must stay first
+  struct MpscNode node;         // Worker queue membership
+  int             client_index; // Client that sent the command
+  char            text[];       // Command line without the line terminator
+};
+
+// Connection state private to one I/O thread
+struct Connection
+{
+  int          is_open;                // 1 while the socket is registered with this thread
+  int          socket_fd;              // Non-blocking client socket
+  unsigned int generation;             // Slot generation the connection was attached with
+  uint64_t     connection_id;          // Unique for the server's lifetime, identifies the connection in captures
+  uint32_t     events;                 // epoll events currently registered
+  char         input[MAX_BUFFER_SIZE]; // Received bytes not yet framed into commands
+  size_t       input_length;           // Bytes used in input
+  size_t       captured_length;        // Bytes at the start of input already written to the capture
+  char        *output;                 // Bytes queued for the client but not yet written
+  size_t       output_length;          // Bytes used in output
+  size_t       output_capacity;        // Bytes allocated for output
+  int          inflight;               // Commands dispatched to a worker and not completed yet
+  int          inflight_worker;        // Worker the in-flight commands were dispatched to
+  int          route_worker;           // Worker owning the client's current guild
+  int          awaiting_route;         // 1 after JOIN or LEAVE until it completes and route_worker is known
+  int          is_half_closed;         // 1 once the client shut down its side, closed after the last reply is written
+};
+
+struct IoThread
+{
+  int               id;
+  pthread_t         thread;
+  int               epoll_fd;
+  struct MpscQueue  queue;                    // Replies for connections owned by this thread
+  struct Connection connections[MAX_CLIENTS]; // Indexed by client slot
+};
+
+struct Worker
+{
+  int              id;
+  pthread_t        thread;
+  struct MpscQueue queue;              // Commands for guilds owned by this worker
+  struct Guild     guilds[MAX_GUILDS]; // Guilds whose name hashes to this worker, only this worker modifies them
+  atomic_int       guild_count;        // Published with release ordering so other workers can list guild names
 };
 
 static struct ClientInfo clients[MAX_CLIENTS];
 static int               client_count = 0;
 
-static struct Guild guilds[MAX_GUILDS];
-static int          guild_count = 0;
+static struct IoThread io_threads[IO_THREAD_COUNT];
+static struct Worker   workers[WORKER_COUNT];
+static atomic_int      total_guild_count;
 
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t guild_mutex  = PTHREAD_MUTEX_INITIALIZER;
-
-static void *handle_client(void *arg);
-void         send_message_to_client(int client_index, const char *message);
-void         broadcast_to_channel(int sender_index, const char *message);
-void         parse_and_execute_command(int client_index, const char *command);
-int          find_or_create_guild(const char *guild_name);
-int          find_or_create_channel(int guild_id, const char *channel_name);
 
-int main(void)
+static struct TimerWheel timer_wheel;
+static unsigned long     handshake_timeout_ticks = HANDSHAKE_TIMEOUT_SECONDS * TIMER_TICKS_PER_SECOND;
+static unsigned long     idle_timeout_ticks      = IDLE_TIMEOUT_SECONDS * TIMER_TICKS_PER_SECOND;
+static unsigned long     pong_timeout_ticks      = PONG_TIMEOUT_SECONDS * TIMER_TICKS_PER_SECOND;
+
+static int fanout_threshold = FANOUT_BATCH_THRESHOLD;
+
+static struct CaptureWriter capture_writer;
+static int                  capture_enabled = 0;
+static struct Timer         capture_flush_timer;
+static sigset_t             stop_signals; // Handled by stop_signal_main while capturing
+static atomic_ullong        next_connection_id;
+
+static struct SearchIndexer search_indexer;
+static const char          *search_directory = SEARCH_INDEX_DIRECTORY;
+
+static void              *io_thread_main(void *arg);
+static void              *worker_main(void *arg);
+static void              *stop_signal_main(void *arg);
+static void               handle_reply(struct IoThread *io, struct Reply *reply);
+static void               deliver_broadcast(struct IoThread *io, struct BroadcastReply *broadcast);
+static void               attach_connection(struct IoThread *io, int client_index, unsigned int generation);
+static void               handle_readable(struct IoThread *io, int client_index);
+static void               capture_input(struct IoThread *io, int client_index);
+static void               dispatch_commands(struct IoThread *io, int client_index);
+static void               append_output(struct IoThread *io, int client_index, const char *data, size_t length);
+static int                flush_output(struct IoThread *io, int client_index);
+static void               update_events(struct IoThread *io, int client_index);
+static void               close_if_finished(struct IoThread *io, int client_index);
+static void               close_connection(struct IoThread *io, int client_index);
+static void               release_slot(int client_index);
+static int                worker_for_guild_name(const char *name, size_t length);
+static struct OutMessage *create_out_message(const char *text, int refs);
+static void               release_out_message(struct OutMessage *message);
+static int  push_reply(
+    int io_thread, int client_index, unsigned int generation, enum ReplyKind kind, struct OutMessage *message
+);
+static int  queue_reply(int client_index, enum ReplyKind kind, struct OutMessage *message);
+static int  queue_reply_locked(int client_index, enum ReplyKind kind, struct OutMessage *message);
+static void queue_message_locked(int client_index, const char *message);
+static void broadcast_batched(
+    struct Recipient recipients[IO_THREAD_COUNT][MAX_CLIENTS], const int recipient_counts[IO_THREAD_COUNT],
+    const char *message
+);
+static void client_timer_expired(struct Timer *timer, void *arg);
+static int  parse_timeout(const char *value, unsigned long *ticks);
+static void capture_flush_expired(struct Timer *timer, void *arg);
+static struct Guild *find_local_guild(struct Worker *worker, const char *guild_name);
+static void          search_guild(struct Worker *worker, int client_index, const char *guild_name, const char *query);
+void        send_message_to_client(int client_index, const char *message);
+void        broadcast_to_channel(int sender_index, const char *message);
+void        parse_and_execute_command(struct Worker *worker, int client_index, const char *command);
+int         find_or_create_guild(struct Worker *worker, const char *guild_name);
+int         find_or_create_channel(struct Worker *worker, int guild_id, const char *channel_name);
+
+int main(int argc, char *argv[])
 {
+  int         opt;
+  const char *capture_path = NULL;
+  while ((opt = getopt(argc, argv, "H:I:P:F:c:S:")) != -1) {
+    switch (opt) {
+    case 'H':
+      if (parse_timeout(optarg, &handshake_timeout_ticks) == -1) {
+        fprintf(stderr, "Invalid handshake timeout: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'I':
+      if (parse_timeout(optarg, &idle_timeout_ticks) == -1) {
+        fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'P':
+      if (parse_timeout(optarg, &pong_timeout_ticks) == -1) {
+        fprintf(stderr, "Invalid PONG timeout: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'F': {
+      char *end;
+      long  threshold = strtol(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || threshold < 0 || threshold > MAX_CLIENTS) {
+        fprintf(stderr, "Invalid fanout threshold: %s\n", optarg);
+        return 1;
+      }
+      fanout_threshold = (int)threshold;
+      break;
+    }
+    case 'c':
+      capture_path = optarg;
+      break;
+    case 'S':
+      search_directory = optarg;
+      break;
+    default:
+      fprintf(
+          stderr,
+          "Usage: %s [-H handshake_seconds] [-I idle_seconds] [-P pong_seconds] [-F fanout_threshold] "
+          "[-c capture_file] [-S search_directory]\n",
+          argv[0]
+      );
+      return 1;
+    }
+  }
+
+  // Writes to peers that went away must surface as EPIPE instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // While capturing, SIGINT and SIGTERM are taken by a thread of its own so the capture is completed before exiting.
+  // Blocked before any other thread is started, they all inherit the mask
+  if (capture_path != NULL) {
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &stop_signals, NULL) != 0) {
+      DIE("pthread_sigmask");
+    }
+  }
+
+  if (timer_wheel_init(&timer_wheel) == -1) {
+    DIE("timer_wheel_init");
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    timer_init(&clients[i].timer, client_timer_expired, (void *)(intptr_t)i);
+  }
+  if (timer_wheel_start(&timer_wheel) == -1) {
+    DIE("timer_wheel_start");
+  }
+
+  if (capture_path != NULL) {
+    if (capture_writer_open(&capture_writer, capture_path) == -1) {
+      DIE("capture_writer_open");
+    }
+    capture_enabled = 1;
+    timer_init(&capture_flush_timer, capture_flush_expired, NULL);
+    timer_arm(&timer_wheel, &capture_flush_timer, TIMER_TICKS_PER_SECOND);
+
+    pthread_t stop_thread;
+    if (pthread_create(&stop_thread, NULL, stop_signal_main, NULL) != 0) {
+      DIE("pthread_create");
+    }
+    pthread_detach(stop_thread);
+    printf("Capturing incoming commands to %s\n", capture_path);
+  }
+
+  if (search_indexer_start(&search_indexer, search_directory) == -1) {
+    DIE(search_directory);
+  }
+
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    workers[i].id = i;
+    if (mpsc_queue_init(&workers[i].queue) == -1) {
+      DIE("mpsc_queue_init");
+    }
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      DIE("pthread_create");
+    }
+  }
+
+  for (int i = 0; i < IO_THREAD_COUNT; i++) {
+    struct IoThread *io = &io_threads[i];
+    io->id              = i;
+    if (mpsc_queue_init(&io->queue) == -1) {
+      DIE("mpsc_queue_init");
+    }
+    if ((io->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      DIE("epoll_create1");
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = IO_QUEUE_EVENT};
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->queue.event_fd, &event) == -1) {
+      DIE("epoll_ctl");
+    }
+    if (pthread_create(&io->thread, NULL, io_thread_main, io) != 0) {
+      DIE("pthread_create");
+    }
+  }
+
   int server_fd;
   if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
     DIE("socket");
   }
 
-  int opt = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+  int reuse = 1;
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1) {
     DIE("setsockopt");
   }
 
@@ -68,6 +353,7 @@ int main(void)
 
   printf("Server listening on port %d\n", PORT);
 
+  int next_io_thread = 0;
   while (1) {
     int                client_socket;
     struct sockaddr_in client_address;
@@ -84,7 +370,7 @@ int main(void)
       pthread_mutex_unlock(&client_mutex);
 
       char *error_message = "ERROR Server is full, try again later.\n";
-      send(client_socket, error_message, strlen(error_message), 0);
+      send(client_socket, error_message, strlen(error_message), MSG_DONTWAIT);
       close(client_socket);
 
       printf(
@@ -105,7 +391,7 @@ int main(void)
       pthread_mutex_unlock(&client_mutex);
 
       char *error_message = "ERROR Server is full, try again later.\n";
-      send(client_socket, error_message, strlen(error_message), 0);
+      send(client_socket, error_message, strlen(error_message), MSG_DONTWAIT);
       close(client_socket);
 
       printf("No free client slot available, rejecting connection\n");
@@ -118,43 +404,33 @@ int main(void)
     clients[client_index].is_active          = 1;
     clients[client_index].current_guild_id   = -1;
     clients[client_index].current_channel_id = -1;
+    clients[client_index].is_registered      = 0;
+    clients[client_index].connected_at       = timer_wheel_now(&timer_wheel);
+    atomic_store_explicit(&clients[client_index].awaiting_pong, 0, memory_order_relaxed);
+    atomic_store_explicit(
+        &clients[client_index].last_activity, clients[client_index].connected_at, memory_order_relaxed
+    );
+    clients[client_index].generation++;
+    clients[client_index].io_thread = next_io_thread;
     strcpy(clients[client_index].username, "Anonymous");
     client_count++;
 
-    int *client_index_ptr = malloc(sizeof(int));
-    if (client_index_ptr == NULL) {
-      perror("malloc");
-
-      char *error_message = "ERROR An unexpected error occurred, try again later.\n";
-      send(client_socket, error_message, strlen(error_message), 0);
-      close(client_socket);
-
-      clients[client_index].is_active = 0;
-      client_count--;
-      pthread_mutex_unlock(&client_mutex);
-      continue;
-    }
-    *client_index_ptr = client_index;
-
-    pthread_t thread_id;
-    if (pthread_create(&thread_id, NULL, handle_client, (void *)client_index_ptr) != 0) {
-      perror("pthread_create");
+    // Armed before the I/O thread sees the connection so its cancel on disconnect always comes after this
+    timer_arm(&timer_wheel, &clients[client_index].timer, handshake_timeout_ticks);
 
+    if (queue_reply_locked(client_index, REPLY_ATTACH, NULL) == -1) {
       char *error_message = "ERROR An unexpected error occurred, try again later.\n";
-      send(client_socket, error_message, strlen(error_message), 0);
+      send(client_socket, error_message, strlen(error_message), MSG_DONTWAIT);
       close(client_socket);
 
       clients[client_index].is_active = 0;
       client_count--;
-
       pthread_mutex_unlock(&client_mutex);
-      free(client_index_ptr); // Free the allocated memory for client index
-      printf("Failed to create thread for client %d, rejecting connection\n", client_index);
       continue;
     }
-
-    pthread_detach(thread_id);
     pthread_mutex_unlock(&client_mutex);
+    next_io_thread = (next_io_thread + 1) % IO_THREAD_COUNT;
+
     printf(
         "Client %d (%s:%d) connected and assigned to slot %d\n", client_index, inet_ntoa(client_address.sin_addr),
         ntohs(client_address.sin_port), client_index
@@ -165,27 +441,191 @@ int main(void)
   return 0;
 }
 
-void *handle_client(void *arg)
+static void *io_thread_main(void *arg)
 {
-  int client_index = *(int *)arg;
-  free(arg); // Free the allocated memory for client index
+  struct IoThread   *io = (struct IoThread *)arg;
+  struct epoll_event events[IO_EVENT_BATCH];
 
-  int     client_socket = clients[client_index].socket_fd;
-  char    buffer[MAX_BUFFER_SIZE];
-  ssize_t bytes_received;
+  while (1) {
+    struct MpscNode *node;
+    while ((node = mpsc_queue_pop(&io->queue)) != NULL) {
+      handle_reply(io, (struct Reply *)node);
+    }
 
-  char welcome_message[100];
-  snprintf(welcome_message, sizeof(welcome_message), "INFO Welcome! Please set your username with NAME <username>.\n");
-  send(client_socket, welcome_message, strlen(welcome_message), 0);
+    int may_block = mpsc_queue_prepare_wait(&io->queue);
+    int count     = epoll_wait(io->epoll_fd, events, IO_EVENT_BATCH, may_block ? -1 : 0);
+    if (may_block) {
+      mpsc_queue_finish_wait(&io->queue);
+    }
+    if (count == -1) {
+      if (errno != EINTR) {
+        perror("epoll_wait");
+      }
+      continue;
+    }
 
-  while ((bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0)) > 0) {
-    buffer[bytes_received]          = '\0';
-    buffer[strcspn(buffer, "\r\n")] = 0; // Remove trailing newline characters
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.u32 == IO_QUEUE_EVENT) {
+        continue; // Drained at the top of the loop
+      }
 
-    printf("Received from client %d: %s\n", client_index, buffer);
+      int client_index = (int)events[i].data.u32;
+      if (!io->connections[client_index].is_open) {
+        continue; // Closed by an earlier event in this batch
+      }
 
-    parse_and_execute_command(client_index, buffer);
-    memset(buffer, 0, sizeof(buffer));
+      if (events[i].events & EPOLLOUT) {
+        if (flush_output(io, client_index) == -1) {
+          close_connection(io, client_index);
+          continue;
+        }
+        update_events(io, client_index);
+        close_if_finished(io, client_index);
+        if (!io->connections[client_index].is_open) {
+          continue;
+        }
+      }
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        // Reported whether or not EPOLLIN is registered, and nothing can be written to the client any more
+        close_connection(io, client_index);
+        continue;
+      }
+      if (events[i].events & EPOLLIN) {
+        handle_readable(io, client_index);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void handle_reply(struct IoThread *io, struct Reply *reply)
+{
+  if (reply->kind == REPLY_BROADCAST) {
+    deliver_broadcast(io, (struct BroadcastReply *)reply);
+    free(reply);
+    return;
+  }
+
+  struct Connection *connection = &io->connections[reply->client_index];
+  int is_current = connection->is_open && connection->generation == reply->generation;
+
+  switch (reply->kind) {
+  case REPLY_ATTACH:
+    attach_connection(io, reply->client_index, reply->generation);
+    break;
+  case REPLY_MESSAGE:
+    if (is_current) {
+      append_output(io, reply->client_index, reply->message->data, reply->message->length);
+    }
+    release_out_message(reply->message);
+    break;
+  case REPLY_DISCONNECT:
+    if (is_current) {
+      flush_output(io, reply->client_index); // Best effort, e.g. for a final ERROR line
+      close_connection(io, reply->client_index);
+    }
+    break;
+  case REPLY_COMMAND_DONE:
+    // The slot is not released while commands are in flight, so this always belongs to the current generation
+    connection->inflight--;
+    connection->route_worker = reply->route_worker;
+    if (connection->inflight == 0) {
+      connection->awaiting_route = 0;
+    }
+
+    if (connection->is_open) {
+      dispatch_commands(io, reply->client_index);
+    } else if (connection->inflight == 0) {
+      release_slot(reply->client_index);
+    }
+    break;
+  case REPLY_BROADCAST:
+    break; // Handled above
+  }
+
+  free(reply);
+}
+
+// Each I/O thread writes its share of a large broadcast, so the per-recipient work runs on all of them in parallel
+static void deliver_broadcast(struct IoThread *io, struct BroadcastReply *broadcast)
+{
+  struct OutMessage *message = broadcast->reply.message;
+  for (int i = 0; i < broadcast->recipient_count; i++) {
+    struct Recipient  *recipient  = &broadcast->recipients[i];
+    struct Connection *connection = &io->connections[recipient->client_index];
+    if (connection->is_open && connection->generation == recipient->generation) {
+      append_output(io, recipient->client_index, message->data, message->length);
+    }
+  }
+  release_out_message(message);
+}
+
+static void attach_connection(struct IoThread *io, int client_index, unsigned int generation)
+{
+  struct Connection *connection = &io->connections[client_index];
+  connection->socket_fd         = clients[client_index].socket_fd;
+  connection->generation        = generation;
+  connection->events            = EPOLLIN;
+  connection->input_length      = 0;
+  connection->captured_length   = 0;
+  connection->output            = NULL;
+  connection->output_length     = 0;
+  connection->output_capacity   = 0;
+  connection->inflight          = 0;
+  connection->inflight_worker   = -1;
+  connection->route_worker      = client_index % WORKER_COUNT;
+  connection->awaiting_route    = 0;
+  connection->is_half_closed    = 0;
+
+  int                flags = fcntl(connection->socket_fd, F_GETFL, 0);
+  struct epoll_event event = {.events = connection->events, .data.u32 = (uint32_t)client_index};
+  if (flags == -1 || fcntl(connection->socket_fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+      epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, connection->socket_fd, &event) == -1) {
+    perror("attach_connection");
+    close(connection->socket_fd);
+    release_slot(client_index);
+    return;
+  }
+
+  // Output is already coalesced per wakeup, so Nagle would only hold pipelined replies back for a delayed ACK
+  int nodelay = 1;
+  setsockopt(connection->socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  connection->is_open       = 1;
+  connection->connection_id = atomic_fetch_add(&next_connection_id, 1);
+  if (capture_enabled) {
+    capture_writer_record(&capture_writer, CAPTURE_OPEN, connection->connection_id, NULL, 0);
+  }
+
+  // Written before the socket is first read so it always precedes replies to the client's commands
+  const char *welcome_message = "INFO Welcome! Please set your username with NAME <username>.\n";
+  append_output(io, client_index, welcome_message, strlen(welcome_message));
+}
+
+static void handle_readable(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  size_t             space      = sizeof(connection->input) - 1 - connection->input_length;
+  if (space == 0) {
+    return; // Waiting for in-flight commands before more input can be framed
+  }
+
+  ssize_t bytes_received = recv(connection->socket_fd, connection->input + connection->input_length, space, 0);
+  if (bytes_received > 0) {
+    connection->input_length += (size_t)bytes_received;
+
+    // Read back by the timer thread, a slightly stale value only delays a deadline by one re-arm
+    atomic_store_explicit(&clients[client_index].last_activity, timer_wheel_now(&timer_wheel), memory_order_relaxed);
+    atomic_store_explicit(&clients[client_index].awaiting_pong, 0, memory_order_relaxed);
+
+    capture_input(io, client_index);
+    dispatch_commands(io, client_index);
+    return;
+  }
+
+  if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
   }
 
   if (bytes_received == 0) {
@@ -193,21 +633,329 @@ void *handle_client(void *arg)
         "Client %d (%s:%d) disconnected\n", client_index, inet_ntoa(clients[client_index].address.sin_addr),
         ntohs(clients[client_index].address.sin_port)
     );
-  } else {
-    perror("recv");
+
+    // Commands it sent before shutting down are still answered, the connection closes once they all are
+    connection->is_half_closed = 1;
+    capture_input(io, client_index);
+    dispatch_commands(io, client_index);
+    return;
+  }
+
+  perror("recv");
+  close_connection(io, client_index);
+}
+
+// Records lines as they arrive, so held back lines keep their arrival time. Framed the same way as dispatch_commands
+static void capture_input(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  if (!capture_enabled) {
+    return;
+  }
+
+  while (connection->captured_length < connection->input_length) {
+    char  *line      = connection->input + connection->captured_length;
+    size_t available = connection->input_length - connection->captured_length;
+    char  *newline   = memchr(line, '\n', available);
+
+    size_t line_length;
+    if (newline != NULL) {
+      line_length = (size_t)(newline - line);
+    } else if ((connection->captured_length == 0 && available == sizeof(connection->input) - 1) ||
+               connection->is_half_closed) {
+      line_length = available;
+    } else {
+      break;
+    }
+    connection->captured_length += newline != NULL ? line_length + 1 : line_length;
+    if (line_length > 0 && line[line_length - 1] == '\r') {
+      line_length--;
+    }
+
+    capture_writer_record(&capture_writer, CAPTURE_DATA, connection->connection_id, line, line_length);
+  }
+}
+
+static int token_equals(const char *token, size_t length, const char *word)
+{
+  return length == strlen(word) && memcmp(token, word, length) == 0;
+}
+
+/*
+ * Frames complete lines into commands. Commands naming a guild go to the worker owning it, everything else to
+ * the worker owning the client's current guild. A connection only ever has commands in flight on one worker so
+ * its replies come back in order, and after JOIN or LEAVE framing pauses until the new route is known.
+ */
+static void dispatch_commands(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  size_t             start      = 0;
+
+  while (!connection->awaiting_route) {
+    char  *line      = connection->input + start;
+    size_t available = connection->input_length - start;
+    char  *newline   = memchr(line, '\n', available);
+
+    size_t line_length;
+    if (newline != NULL) {
+      line_length = (size_t)(newline - line);
+    } else if (start == 0 && available == sizeof(connection->input) - 1) {
+      line_length = available; // Longer than the buffer, process what fits
+    } else if (connection->is_half_closed && available > 0) {
+      line_length = available; // The client will not finish the line, run what it sent
+    } else {
+      break;
+    }
+    size_t consumed = newline != NULL ? line_length + 1 : line_length;
+    if (line_length > 0 && line[line_length - 1] == '\r') {
+      line_length--;
+    }
+
+    // Split off the command and its first argument without modifying the line
+    const char *verb = line;
+    while (verb < line + line_length && *verb == ' ') {
+      verb++;
+    }
+    size_t verb_length = 0;
+    while (verb + verb_length < line + line_length && verb[verb_length] != ' ') {
+      verb_length++;
+    }
+    const char *arg = verb + verb_length;
+    while (arg < line + line_length && *arg == ' ') {
+      arg++;
+    }
+    size_t arg_length = 0;
+    while (arg + arg_length < line + line_length && arg[arg_length] != ' ') {
+      arg_length++;
+    }
+
+    int is_local      = verb_length == 0 || token_equals(verb, verb_length, "PONG");
+    int changes_route = token_equals(verb, verb_length, "JOIN") || token_equals(verb, verb_length, "LEAVE");
+    int target        = connection->route_worker;
+    if (arg_length > 0 && (token_equals(verb, verb_length, "JOIN") || token_equals(verb, verb_length, "CREATEGUILD") ||
+                           token_equals(verb, verb_length, "LISTCHANNELS") ||
+                           token_equals(verb, verb_length, "SEARCH"))) {
+      target = worker_for_guild_name(arg, arg_length);
+    }
+
+    if (!is_local && connection->inflight > 0 && target != connection->inflight_worker) {
+      break; // Resumed once the other worker completes
+    }
+
+    start += consumed;
+
+    if (verb_length == 0) {
+      printf("Client %d sent an empty command\n", client_index);
+      continue;
+    }
+    if (is_local) {
+      continue; // PONG, receiving it already refreshed the idle deadline
+    }
+
+    struct Command *command = malloc(sizeof(struct Command) + line_length + 1);
+    if (command == NULL) {
+      perror("malloc");
+      send_message_to_client(client_index, "ERROR An unexpected error occurred, try again later.\n");
+      continue;
+    }
+    command->done.kind         = REPLY_COMMAND_DONE;
+    command->done.client_index = client_index;
+    command->done.generation   = connection->generation;
+    command->done.message      = NULL;
+    command->client_index      = client_index;
+    memcpy(command->text, line, line_length);
+    command->text[line_length] = '\0';
+
+    connection->inflight++;
+    connection->inflight_worker = target;
+    if (changes_route) {
+      connection->awaiting_route = 1;
+    }
+    mpsc_queue_push(&workers[target].queue, &command->node);
+  }
+
+  if (start > 0) {
+    memmove(connection->input, connection->input + start, connection->input_length - start);
+    connection->input_length -= start;
+    if (capture_enabled) {
+      connection->captured_length -= start;
+    }
+  }
+  update_events(io, client_index);
+  close_if_finished(io, client_index);
+}
+
+static void append_output(struct IoThread *io, int client_index, const char *data, size_t length)
+{
+  struct Connection *connection = &io->connections[client_index];
+
+  // Nothing queued ahead of it, so try to write straight from the shared message
+  if (connection->output_length == 0) {
+    ssize_t bytes_sent = send(connection->socket_fd, data, length, 0);
+    if (bytes_sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("send");
+      close_connection(io, client_index);
+      return;
+    }
+    if (bytes_sent > 0) {
+      data += bytes_sent;
+      length -= (size_t)bytes_sent;
+    }
+    if (length == 0) {
+      return;
+    }
+  }
+
+  if (connection->output_length + length > OUTPUT_BUFFER_LIMIT) {
+    printf("Client %d is not reading its messages, disconnecting\n", client_index);
+    close_connection(io, client_index);
+    return;
   }
 
+  if (connection->output_length + length > connection->output_capacity) {
+    size_t capacity = connection->output_capacity > 0 ? connection->output_capacity : MAX_BUFFER_SIZE;
+    while (capacity < connection->output_length + length) {
+      capacity *= 2;
+    }
+    char *output = realloc(connection->output, capacity);
+    if (output == NULL) {
+      perror("realloc");
+      close_connection(io, client_index);
+      return;
+    }
+    connection->output          = output;
+    connection->output_capacity = capacity;
+  }
+
+  memcpy(connection->output + connection->output_length, data, length);
+  connection->output_length += length;
+  update_events(io, client_index);
+}
+
+// Writes as much buffered output as the socket accepts, returns -1 if the connection failed
+static int flush_output(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  size_t             written    = 0;
+
+  while (written < connection->output_length) {
+    ssize_t bytes_sent =
+        send(connection->socket_fd, connection->output + written, connection->output_length - written, 0);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      perror("send");
+      return -1;
+    }
+    written += (size_t)bytes_sent;
+  }
+
+  memmove(connection->output, connection->output + written, connection->output_length - written);
+  connection->output_length -= written;
+  return 0;
+}
+
+// Only asks for input while there is room to frame it and for writability while output is pending
+static void update_events(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  if (!connection->is_open) {
+    return;
+  }
+
+  uint32_t events = 0;
+  if (!connection->is_half_closed && connection->input_length < sizeof(connection->input) - 1) {
+    events |= EPOLLIN;
+  }
+  if (connection->output_length > 0) {
+    events |= EPOLLOUT;
+  }
+  if (events == connection->events) {
+    return;
+  }
+
+  struct epoll_event event = {.events = events, .data.u32 = (uint32_t)client_index};
+  if (epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, connection->socket_fd, &event) == -1) {
+    perror("epoll_ctl");
+    return;
+  }
+  connection->events = events;
+}
+
+// Closes a half-closed connection once every command it sent has run and every reply has been written
+static void close_if_finished(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  if (connection->is_open && connection->is_half_closed && connection->input_length == 0 &&
+      connection->inflight == 0 && connection->output_length == 0) {
+    close_connection(io, client_index);
+  }
+}
+
+static void close_connection(struct IoThread *io, int client_index)
+{
+  struct Connection *connection = &io->connections[client_index];
+  if (!connection->is_open) {
+    return;
+  }
+
+  epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
+  close(connection->socket_fd);
+  free(connection->output);
+  connection->output          = NULL;
+  connection->output_length   = 0;
+  connection->output_capacity = 0;
+  connection->is_open         = 0;
+  if (capture_enabled) {
+    capture_writer_record(&capture_writer, CAPTURE_CLOSE, connection->connection_id, NULL, 0);
+  }
+
+  // Workers may still run commands for this slot, it is reused only after the last one completes
+  if (connection->inflight == 0) {
+    release_slot(client_index);
+  }
+}
+
+static void release_slot(int client_index)
+{
+  timer_cancel(&timer_wheel, &clients[client_index].timer);
+
   pthread_mutex_lock(&client_mutex);
   clients[client_index].is_active = 0;
-  close(client_socket);
   client_count--;
   pthread_mutex_unlock(&client_mutex);
 
   printf("Client %d disconnected and slot freed\n", client_index);
+}
+
+static void *worker_main(void *arg)
+{
+  struct Worker *worker = (struct Worker *)arg;
+
+  while (1) {
+    struct MpscNode *node         = mpsc_queue_pop_wait(&worker->queue);
+    struct Command  *command      = (struct Command *)((char *)node - offsetof(struct Command, node));
+    int              client_index = command->client_index;
+
+    printf("Received from client %d: %s\n", client_index, command->text);
+    parse_and_execute_command(worker, client_index, command->text);
+
+    // Only the worker running the client's command changes its guild, so reading it back needs no lock
+    int guild_id               = clients[client_index].current_guild_id;
+    command->done.route_worker = guild_id != -1 ? guild_id % WORKER_COUNT : client_index % WORKER_COUNT;
+
+    // The I/O thread frees the command along with the reply
+    mpsc_queue_push(&io_threads[clients[client_index].io_thread].queue, &command->done.node);
+  }
+
   return NULL;
 }
 
-void parse_and_execute_command(int client_index, const char *buffer)
+void parse_and_execute_command(struct Worker *worker, int client_index, const char *buffer)
 {
   char *command, *arg1, *arg2, *payload;
   char *saveptr;
@@ -237,6 +985,7 @@ void parse_and_execute_command(int client_index, const char *buffer)
         pthread_mutex_lock(&client_mutex);
         strncpy(clients[client_index].username, arg1, MAX_USERNAME_SIZE - 1);
         clients[client_index].username[MAX_USERNAME_SIZE - 1] = '\0';
+        clients[client_index].is_registered                   = 1;
         pthread_mutex_unlock(&client_mutex);
 
         char message[MAX_BUFFER_SIZE];
@@ -249,7 +998,7 @@ void parse_and_execute_command(int client_index, const char *buffer)
   } else if (strcmp(command, "CREATEGUILD") == 0) {
     arg1 = strtok_r(NULL, " ", &saveptr);
     if (arg1 && strlen(arg1) < MAX_NAME_LENGTH) {
-      int guild_id = find_or_create_guild(arg1);
+      int guild_id = find_or_create_guild(worker, arg1);
       if (guild_id != -1) {
         char message[MAX_BUFFER_SIZE];
         snprintf(message, sizeof(message), "INFO Guild '%s' created. Default channel '#general' is available.\n", arg1);
@@ -264,9 +1013,9 @@ void parse_and_execute_command(int client_index, const char *buffer)
     arg1 = strtok_r(NULL, " ", &saveptr); // Guild name
     arg2 = strtok_r(NULL, " ", &saveptr); // Channel name
     if (arg1 && arg2) {
-      int guild_id = find_or_create_guild(arg1);
+      int guild_id = find_or_create_guild(worker, arg1);
       if (guild_id != -1) {
-        int channel_id = find_or_create_channel(guild_id, arg2);
+        int channel_id = find_or_create_channel(worker, guild_id, arg2);
         if (channel_id != -1) {
           pthread_mutex_lock(&client_mutex);
           clients[client_index].current_guild_id   = guild_id;
@@ -293,37 +1042,46 @@ void parse_and_execute_command(int client_index, const char *buffer)
         payload++;
       }
 
-      pthread_mutex_lock(&client_mutex);
-      if (clients[client_index].current_guild_id == -1 || clients[client_index].current_channel_id == -1) {
-        pthread_mutex_unlock(&client_mutex);
+      int guild_id   = clients[client_index].current_guild_id;
+      int channel_id = clients[client_index].current_channel_id;
+      if (guild_id == -1 || channel_id == -1) {
         send_message_to_client(
             client_index,
             "ERROR You must join a guild and channel before sending messages with JOIN <guild> <channel>.\n"
         );
         return;
       }
-      pthread_mutex_unlock(&client_mutex);
 
       char message_to_broadcast[MAX_BUFFER_SIZE];
       snprintf(
-          message_to_broadcast, sizeof(message_to_broadcast), "MSG %d %d %s %s\n",
-          clients[client_index].current_guild_id, clients[client_index].current_channel_id,
+          message_to_broadcast, sizeof(message_to_broadcast), "MSG %d %d %s %s\n", guild_id, channel_id,
           clients[client_index].username, payload
       );
       broadcast_to_channel(client_index, message_to_broadcast);
+
+      // Indexed after delivery so searching never delays the broadcast, MSG runs on the worker owning the guild
+      if (guild_id % WORKER_COUNT == worker->id &&
+          search_index_add(
+              &worker->guilds[guild_id / WORKER_COUNT].index, channel_id, clients[client_index].username, payload
+          ) == -1) {
+        perror("search_index_add");
+      }
     } else {
       send_message_to_client(client_index, "ERROR MSG command requires a message payload.\n");
     }
   } else if (strcmp(command, "LISTGUILDS") == 0) {
     char list_string[MAX_BUFFER_SIZE] = "GUILDLIST ";
-    pthread_mutex_lock(&guild_mutex);
-    for (int i = 0; i < guild_count; i++) {
-      strncat(list_string, guilds[i].name, sizeof(list_string) - strlen(list_string) - 1);
-      if (i < guild_count - 1) {
-        strncat(list_string, ", ", sizeof(list_string) - strlen(list_string) - 1);
+    int  listed                       = 0;
+    for (int w = 0; w < WORKER_COUNT; w++) {
+      // Guild names never change once published, so other workers' tables can be read without locking
+      int count = atomic_load_explicit(&workers[w].guild_count, memory_order_acquire);
+      for (int i = 0; i < count; i++) {
+        if (listed++ > 0) {
+          strncat(list_string, ", ", sizeof(list_string) - strlen(list_string) - 1);
+        }
+        strncat(list_string, workers[w].guilds[i].name, sizeof(list_string) - strlen(list_string) - 1);
       }
     }
-    pthread_mutex_unlock(&guild_mutex);
     strncat(list_string, "\n", sizeof(list_string) - strlen(list_string) - 1);
     send_message_to_client(client_index, list_string);
   } else if (strcmp(command, "LISTCHANNELS") == 0) {
@@ -331,25 +1089,15 @@ void parse_and_execute_command(int client_index, const char *buffer)
     if (arg1) {
       char list_string[MAX_BUFFER_SIZE];
       snprintf(list_string, sizeof(list_string), "CHANNELLIST %s ", arg1);
-      pthread_mutex_lock(&guild_mutex);
-      int guild_id = -1;
-      for (int i = 0; i < guild_count; i++) {
-        if (strcmp(guilds[i].name, arg1) == 0) {
-          guild_id = guilds[i].id;
-          break;
-        }
-      }
-      pthread_mutex_unlock(&guild_mutex);
 
-      if (guild_id != -1) {
-        pthread_mutex_lock(&guild_mutex);
-        for (int j = 0; j < guilds[guild_id].channel_count; j++) {
-          strncat(list_string, guilds[guild_id].channels[j].name, sizeof(list_string) - strlen(list_string) - 1);
-          if (j < guilds[guild_id].channel_count - 1) {
+      struct Guild *guild = find_local_guild(worker, arg1);
+      if (guild != NULL) {
+        for (int j = 0; j < guild->channel_count; j++) {
+          strncat(list_string, guild->channels[j].name, sizeof(list_string) - strlen(list_string) - 1);
+          if (j < guild->channel_count - 1) {
             strncat(list_string, ", ", sizeof(list_string) - strlen(list_string) - 1);
           }
         }
-        pthread_mutex_unlock(&guild_mutex);
 
         strncat(list_string, "\n", sizeof(list_string) - strlen(list_string) - 1);
         send_message_to_client(client_index, list_string);
@@ -359,6 +1107,14 @@ void parse_and_execute_command(int client_index, const char *buffer)
     } else {
       send_message_to_client(client_index, "ERROR LISTCHANNELS command requires a guild name.\n");
     }
+  } else if (strcmp(command, "SEARCH") == 0) {
+    arg1    = strtok_r(NULL, " ", &saveptr); // Guild name
+    payload = strtok_r(NULL, "", &saveptr);  // Search terms
+    if (arg1 && payload) {
+      search_guild(worker, client_index, arg1, payload);
+    } else {
+      send_message_to_client(client_index, "ERROR SEARCH command requires a guild name and search terms.\n");
+    }
   } else if (strcmp(command, "LEAVE") == 0) {
     if (clients[client_index].current_guild_id != -1) {
       pthread_mutex_lock(&client_mutex);
@@ -375,20 +1131,83 @@ void parse_and_execute_command(int client_index, const char *buffer)
         "Client %d (%s:%d) requested to quit\n", client_index, inet_ntoa(clients[client_index].address.sin_addr),
         ntohs(clients[client_index].address.sin_port)
     );
-    close(clients[client_index].socket_fd);
 
-    pthread_mutex_lock(&client_mutex);
-    clients[client_index].is_active = 0;
-    client_count--;
-    pthread_mutex_unlock(&client_mutex);
-
-    printf("Client %d disconnected and slot freed\n", client_index);
-    pthread_exit(NULL);
+    queue_reply(client_index, REPLY_DISCONNECT, NULL);
   } else {
     send_message_to_client(client_index, "ERROR Unknown command.\n");
   }
 }
 
+static struct OutMessage *create_out_message(const char *text, int refs)
+{
+  size_t             length  = strlen(text);
+  struct OutMessage *message = malloc(sizeof(struct OutMessage) + length);
+  if (message == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+
+  atomic_init(&message->refs, refs);
+  message->length = length;
+  memcpy(message->data, text, length);
+  return message;
+}
+
+static void release_out_message(struct OutMessage *message)
+{
+  if (atomic_fetch_sub(&message->refs, 1) == 1) {
+    free(message);
+  }
+}
+
+// Returns -1 if the reply could not be allocated
+static int push_reply(
+    int io_thread, int client_index, unsigned int generation, enum ReplyKind kind, struct OutMessage *message
+)
+{
+  struct Reply *reply = malloc(sizeof(struct Reply));
+  if (reply == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  reply->kind         = kind;
+  reply->client_index = client_index;
+  reply->generation   = generation;
+  reply->route_worker = -1;
+  reply->message      = message;
+  mpsc_queue_push(&io_threads[io_thread].queue, &reply->node);
+  return 0;
+}
+
+/*
+ * Queues a reply to the client whose command is running. Its slot is not reused while the command is in flight,
+ * so the I/O thread and generation can be read without client_mutex. Returns -1 if the reply could not be allocated.
+ */
+static int queue_reply(int client_index, enum ReplyKind kind, struct OutMessage *message)
+{
+  return push_reply(clients[client_index].io_thread, client_index, clients[client_index].generation, kind, message);
+}
+
+// Must be called with client_mutex held, returns -1 if the reply could not be allocated
+static int queue_reply_locked(int client_index, enum ReplyKind kind, struct OutMessage *message)
+{
+  return push_reply(clients[client_index].io_thread, client_index, clients[client_index].generation, kind, message);
+}
+
+// Must be called with client_mutex held
+static void queue_message_locked(int client_index, const char *message)
+{
+  if (!clients[client_index].is_active) {
+    return;
+  }
+
+  struct OutMessage *out = create_out_message(message, 1);
+  if (out != NULL && queue_reply_locked(client_index, REPLY_MESSAGE, out) == -1) {
+    release_out_message(out);
+  }
+}
+
 void send_message_to_client(int client_index, const char *message)
 {
   if (client_index < 0 || client_index >= MAX_CLIENTS) {
@@ -396,13 +1215,11 @@ void send_message_to_client(int client_index, const char *message)
     return;
   }
 
-  pthread_mutex_lock(&client_mutex);
-  if (clients[client_index].is_active) {
-    if (send(clients[client_index].socket_fd, message, strlen(message), 0) == -1) {
-      perror("send");
-    }
+  // Only ever called for the client whose command is running, see queue_reply()
+  struct OutMessage *out = create_out_message(message, 1);
+  if (out != NULL && queue_reply(client_index, REPLY_MESSAGE, out) == -1) {
+    release_out_message(out);
   }
-  pthread_mutex_unlock(&client_mutex);
 }
 
 void broadcast_to_channel(int sender_index, const char *message)
@@ -412,72 +1229,207 @@ void broadcast_to_channel(int sender_index, const char *message)
     return;
   }
 
-  pthread_mutex_lock(&client_mutex);
+  // Runs the sender's MSG, so like there its own guild and channel are stable without locking
   int guild_id   = clients[sender_index].current_guild_id;
   int channel_id = clients[sender_index].current_channel_id;
-
   if (guild_id == -1 || channel_id == -1) {
-    pthread_mutex_unlock(&client_mutex);
     return; // Not in a guild or channel
   }
 
+  // Snapshot the recipients grouped by owning I/O thread, their generation tells if a slot is reused meanwhile
+  struct Recipient recipients[IO_THREAD_COUNT][MAX_CLIENTS];
+  int              recipient_counts[IO_THREAD_COUNT] = {0};
+  int              recipient_count                   = 0;
+  pthread_mutex_lock(&client_mutex);
   for (int i = 0; i < MAX_CLIENTS; i++) {
     if (clients[i].is_active && clients[i].current_guild_id == guild_id &&
         clients[i].current_channel_id == channel_id) {
-      if (send(clients[i].socket_fd, message, strlen(message), 0) == -1) {
-        perror("send");
-      }
+      int               io_thread = clients[i].io_thread;
+      struct Recipient *recipient = &recipients[io_thread][recipient_counts[io_thread]++];
+      recipient->client_index     = i;
+      recipient->generation       = clients[i].generation;
+      recipient_count++;
     }
   }
   pthread_mutex_unlock(&client_mutex);
+
+  // A channel's broadcasts all come from the worker owning its guild, so queueing unlocked keeps them in order
+  if (recipient_count > fanout_threshold) {
+    broadcast_batched(recipients, recipient_counts, message);
+    return;
+  }
+
+  // One shared copy for all recipients, each I/O thread drops its reference once the bytes are buffered
+  struct OutMessage *out = recipient_count > 0 ? create_out_message(message, recipient_count) : NULL;
+  if (out == NULL) {
+    return;
+  }
+  for (int io_thread = 0; io_thread < IO_THREAD_COUNT; io_thread++) {
+    for (int i = 0; i < recipient_counts[io_thread]; i++) {
+      struct Recipient *recipient = &recipients[io_thread][i];
+      if (push_reply(io_thread, recipient->client_index, recipient->generation, REPLY_MESSAGE, out) == -1) {
+        release_out_message(out);
+      }
+    }
+  }
+}
+
+// Hands each I/O thread one reply listing all of its recipients instead of one reply per recipient
+static void broadcast_batched(
+    struct Recipient recipients[IO_THREAD_COUNT][MAX_CLIENTS], const int recipient_counts[IO_THREAD_COUNT],
+    const char *message
+)
+{
+  int batch_count = 0;
+  for (int io_thread = 0; io_thread < IO_THREAD_COUNT; io_thread++) {
+    batch_count += recipient_counts[io_thread] > 0;
+  }
+
+  struct OutMessage *out = create_out_message(message, batch_count);
+  if (out == NULL) {
+    return;
+  }
+  for (int io_thread = 0; io_thread < IO_THREAD_COUNT; io_thread++) {
+    int count = recipient_counts[io_thread];
+    if (count == 0) {
+      continue;
+    }
+
+    struct BroadcastReply *broadcast = malloc(sizeof(struct BroadcastReply) + sizeof(struct Recipient) * count);
+    if (broadcast == NULL) {
+      perror("malloc");
+      release_out_message(out);
+      continue;
+    }
+    broadcast->reply.kind         = REPLY_BROADCAST;
+    broadcast->reply.client_index = -1;
+    broadcast->reply.generation   = 0;
+    broadcast->reply.route_worker = -1;
+    broadcast->reply.message      = out;
+    broadcast->recipient_count    = count;
+    memcpy(broadcast->recipients, recipients[io_thread], sizeof(struct Recipient) * count);
+    mpsc_queue_push(&io_threads[io_thread].queue, &broadcast->reply.node);
+  }
+}
+
+static int worker_for_guild_name(const char *name, size_t length)
+{
+  // Guild names are stored truncated, hash the same prefix so both spellings land on the same worker
+  if (length > MAX_NAME_LENGTH - 1) {
+    length = MAX_NAME_LENGTH - 1;
+  }
+
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return (int)(hash % WORKER_COUNT);
 }
 
-int find_or_create_guild(const char *guild_name)
+int find_or_create_guild(struct Worker *worker, const char *guild_name)
 {
-  pthread_mutex_lock(&guild_mutex);
-  for (int i = 0; i < guild_count; i++) {
-    if (strcmp(guilds[i].name, guild_name) == 0) {
-      pthread_mutex_unlock(&guild_mutex);
-      return guilds[i].id;
+  int count = atomic_load_explicit(&worker->guild_count, memory_order_relaxed);
+  for (int i = 0; i < count; i++) {
+    if (strcmp(worker->guilds[i].name, guild_name) == 0) {
+      return worker->guilds[i].id;
     }
   }
 
-  if (guild_count >= MAX_GUILDS) {
-    pthread_mutex_unlock(&guild_mutex);
+  if (count >= MAX_GUILDS) {
+    return -1; // Guild limit reached
+  }
+  if (atomic_fetch_add(&total_guild_count, 1) >= MAX_GUILDS) {
+    atomic_fetch_sub(&total_guild_count, 1);
     return -1; // Guild limit reached
   }
 
-  int new_guild_id = guild_count;
-  strncpy(guilds[new_guild_id].name, guild_name, MAX_NAME_LENGTH - 1);
-  guilds[new_guild_id].name[MAX_NAME_LENGTH - 1] = '\0';
-  guilds[new_guild_id].id                        = new_guild_id;
-  guild_count++;
-  pthread_mutex_unlock(&guild_mutex);
+  // Guild IDs encode the owning worker so the owner can be found from the ID alone
+  struct Guild *guild = &worker->guilds[count];
+  strncpy(guild->name, guild_name, MAX_NAME_LENGTH - 1);
+  guild->name[MAX_NAME_LENGTH - 1] = '\0';
+  guild->id                        = count * WORKER_COUNT + worker->id;
+  guild->channel_count             = 0;
+  search_index_init(&guild->index, &search_indexer);
+  atomic_store_explicit(&worker->guild_count, count + 1, memory_order_release);
 
   // Automatically create a default channel
-  find_or_create_channel(new_guild_id, "general");
+  find_or_create_channel(worker, guild->id, "general");
+
+  return guild->id;
+}
+
+// Finds a guild owned by the worker by name
+static struct Guild *find_local_guild(struct Worker *worker, const char *guild_name)
+{
+  int count = atomic_load_explicit(&worker->guild_count, memory_order_relaxed);
+  for (int i = 0; i < count; i++) {
+    if (strcmp(worker->guilds[i].name, guild_name) == 0) {
+      return &worker->guilds[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Replies with the newest messages in the guild containing every word of the query, as a SEARCHRESULT line with
+ * the hit count followed by one SEARCHHIT line per message. The lines are queued as one message so they arrive
+ * together.
+ */
+static void search_guild(struct Worker *worker, int client_index, const char *guild_name, const char *query)
+{
+  struct Guild *guild = find_local_guild(worker, guild_name);
+  if (guild == NULL) {
+    send_message_to_client(client_index, "ERROR Guild not found.\n");
+    return;
+  }
+
+  struct SearchHit hits[SEARCH_RESULT_LIMIT];
+  int              hit_count = search_index_query(&guild->index, query, hits, SEARCH_RESULT_LIMIT);
+  if (hit_count == -1) {
+    send_message_to_client(client_index, "ERROR SEARCH terms must contain a letter or digit.\n");
+    return;
+  }
+
+  size_t size = MAX_BUFFER_SIZE;
+  for (int i = 0; i < hit_count; i++) {
+    size += MAX_NAME_LENGTH + (size_t)hits[i].username_length + (size_t)hits[i].text_length + 16;
+  }
+  char *reply = malloc(size);
+  if (reply == NULL) {
+    perror("malloc");
+    send_message_to_client(client_index, "ERROR An unexpected error occurred, try again later.\n");
+    return;
+  }
 
-  return new_guild_id;
+  size_t length = (size_t)snprintf(reply, size, "SEARCHRESULT %s %d\n", guild->name, hit_count);
+  for (int i = 0; i < hit_count && length < size; i++) {
+    const char *channel_name = hits[i].channel_id >= 0 && hits[i].channel_id < guild->channel_count
+                                   ? guild->channels[hits[i].channel_id].name
+                                   : "unknown";
+    length += (size_t)snprintf(
+        reply + length, size - length, "SEARCHHIT %s %.*s %.*s\n", channel_name, hits[i].username_length,
+        hits[i].username, hits[i].text_length, hits[i].text
+    );
+  }
+  send_message_to_client(client_index, reply);
+  free(reply);
 }
 
-int find_or_create_channel(int guild_id, const char *channel_name)
+int find_or_create_channel(struct Worker *worker, int guild_id, const char *channel_name)
 {
-  pthread_mutex_lock(&guild_mutex);
-  if (guild_id < 0 || guild_id >= guild_count) {
-    pthread_mutex_unlock(&guild_mutex);
+  if (guild_id < 0 || guild_id % WORKER_COUNT != worker->id ||
+      guild_id / WORKER_COUNT >= atomic_load_explicit(&worker->guild_count, memory_order_relaxed)) {
     return -1; // Invalid guild ID
   }
 
-  struct Guild *guild = &guilds[guild_id];
+  struct Guild *guild = &worker->guilds[guild_id / WORKER_COUNT];
   for (int i = 0; i < guild->channel_count; i++) {
     if (strcmp(guild->channels[i].name, channel_name) == 0) {
-      pthread_mutex_unlock(&guild_mutex);
       return guild->channels[i].id; // Channel already exists
     }
   }
 
   if (guild->channel_count >= MAX_CHANNELS_PER_GUILD) {
-    pthread_mutex_unlock(&guild_mutex);
     return -1; // Channel limit reached
   }
 
@@ -487,6 +1439,90 @@ int find_or_create_channel(int guild_id, const char *channel_name)
   guild->channels[new_channel_id].id                        = new_channel_id;
   guild->channel_count++;
 
-  pthread_mutex_unlock(&guild_mutex);
   return new_channel_id;
 }
+
+static int parse_timeout(const char *value, unsigned long *ticks)
+{
+  char *end;
+  long  seconds = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || seconds <= 0 || seconds > 30L * 24 * 60 * 60) {
+    return -1;
+  }
+
+  *ticks = (unsigned long)seconds * TIMER_TICKS_PER_SECOND;
+  return 0;
+}
+
+/*
+ * Every deadline is re-derived from the client's timestamps, so activity never has to touch the wheel and a
+ * stale expiry (e.g. left over from the slot's previous occupant) simply re-arms for the real deadline.
+ */
+static void client_timer_expired(struct Timer *timer, void *arg)
+{
+  int           client_index = (int)(intptr_t)arg;
+  unsigned long now          = timer_wheel_now(&timer_wheel);
+
+  pthread_mutex_lock(&client_mutex);
+  struct ClientInfo *client = &clients[client_index];
+  if (!client->is_active) {
+    pthread_mutex_unlock(&client_mutex);
+    return;
+  }
+
+  const char   *reason = NULL;
+  unsigned long deadline;
+  if (!client->is_registered) {
+    deadline = client->connected_at + handshake_timeout_ticks;
+    if (now >= deadline) {
+      queue_message_locked(client_index, "ERROR Handshake timed out.\n");
+      reason = "did not complete the handshake";
+    }
+  } else if (atomic_load_explicit(&client->awaiting_pong, memory_order_relaxed)) {
+    deadline = client->ping_sent_at + pong_timeout_ticks;
+    if (now >= deadline) {
+      reason = "did not answer PING";
+    }
+  } else {
+    deadline = atomic_load_explicit(&client->last_activity, memory_order_relaxed) + idle_timeout_ticks;
+    if (now >= deadline) {
+      queue_message_locked(client_index, "PING\n");
+      atomic_store_explicit(&client->awaiting_pong, 1, memory_order_relaxed);
+      client->ping_sent_at = now;
+      deadline             = now + pong_timeout_ticks;
+    }
+  }
+
+  if (reason) {
+    // The owning I/O thread closes the socket and releases the slot as for any disconnect
+    queue_reply_locked(client_index, REPLY_DISCONNECT, NULL);
+    pthread_mutex_unlock(&client_mutex);
+    printf("Client %d %s in time, disconnecting\n", client_index, reason);
+    return;
+  }
+
+  timer_arm(&timer_wheel, timer, deadline - now);
+  pthread_mutex_unlock(&client_mutex);
+}
+
+// Keeps at most a second of capture in stdio's buffer should the server die without a chance to close it
+static void capture_flush_expired(struct Timer *timer, void *arg)
+{
+  (void)arg;
+  capture_writer_flush(&capture_writer);
+  timer_arm(&timer_wheel, timer, TIMER_TICKS_PER_SECOND);
+}
+
+// Stopping a capture with Ctrl-C or kill writes out everything recorded so far and ends it on a complete record
+static void *stop_signal_main(void *arg)
+{
+  (void)arg;
+  int signal_number;
+  if (sigwait(&stop_signals, &signal_number) != 0) {
+    DIE("sigwait");
+  }
+
+  printf("Received signal %d, closing the capture\n", signal_number);
+  capture_writer_close(&capture_writer);
+  exit(EXIT_SUCCESS);
+}
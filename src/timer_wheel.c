@@ -0,0 +1,223 @@
+#include "timer_wheel.h"
+
+#include <time.h>
+
+static void *timer_thread(void *arg);
+static void  wheel_insert(struct TimerWheel *wheel, struct Timer *timer);
+static void  wheel_advance(struct TimerWheel *wheel);
+
+static void link_init(struct TimerLink *head)
+{
+  head->next = head;
+  head->prev = head;
+}
+
+static int link_empty(const struct TimerLink *head) { return head->next == head; }
+
+static void link_add_tail(struct TimerLink *head, struct TimerLink *link)
+{
+  link->prev       = head->prev;
+  link->next       = head;
+  head->prev->next = link;
+  head->prev       = link;
+}
+
+static void link_remove(struct TimerLink *link)
+{
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link_init(link);
+}
+
+// Moves every entry of `from` to the tail of `to`, leaving `from` empty
+static void link_splice(struct TimerLink *from, struct TimerLink *to)
+{
+  if (link_empty(from)) {
+    return;
+  }
+
+  from->next->prev = to->prev;
+  to->prev->next   = from->next;
+  from->prev->next = to;
+  to->prev         = from->prev;
+  link_init(from);
+}
+
+int timer_wheel_init(struct TimerWheel *wheel)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  atomic_init(&wheel->now, 0);
+  if (pthread_mutex_init(&wheel->mutex, NULL) != 0) {
+    return -1;
+  }
+  if (pthread_cond_init(&wheel->callback_done, NULL) != 0) {
+    pthread_mutex_destroy(&wheel->mutex);
+    return -1;
+  }
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      link_init(&wheel->slots[level][slot]);
+    }
+  }
+  link_init(&wheel->expired);
+
+  if (clock_gettime(CLOCK_MONOTONIC, &wheel->start) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+int timer_wheel_start(struct TimerWheel *wheel)
+{
+  if (pthread_create(&wheel->thread, NULL, timer_thread, wheel) != 0) {
+    return -1;
+  }
+  pthread_detach(wheel->thread);
+  return 0;
+}
+
+// Lock-free so it is cheap enough to call on every received chunk
+unsigned long timer_wheel_now(struct TimerWheel *wheel)
+{
+  return atomic_load_explicit(&wheel->now, memory_order_relaxed);
+}
+
+void timer_init(struct Timer *timer, void (*callback)(struct Timer *timer, void *arg), void *arg)
+{
+  link_init(&timer->link);
+  timer->expires    = 0;
+  timer->is_pending = 0;
+  timer->callback   = callback;
+  timer->arg        = arg;
+}
+
+void timer_arm(struct TimerWheel *wheel, struct Timer *timer, unsigned long ticks)
+{
+  pthread_mutex_lock(&wheel->mutex);
+  if (timer->is_pending) {
+    link_remove(&timer->link);
+  }
+
+  // The slot for the current tick has already been dispatched, so fire on the next one at the earliest
+  timer->expires    = atomic_load_explicit(&wheel->now, memory_order_relaxed) + (ticks > 0 ? ticks : 1);
+  timer->is_pending = 1;
+  wheel_insert(wheel, timer);
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+void timer_cancel(struct TimerWheel *wheel, struct Timer *timer)
+{
+  pthread_mutex_lock(&wheel->mutex);
+  if (timer->is_pending) {
+    link_remove(&timer->link);
+    timer->is_pending = 0;
+  }
+
+  // Wait out a callback that is already running so the caller may safely reuse what it points to
+  while (wheel->running == timer && !pthread_equal(pthread_self(), wheel->thread)) {
+    pthread_cond_wait(&wheel->callback_done, &wheel->mutex);
+  }
+
+  // The callback may have re-armed the timer while we waited
+  if (timer->is_pending) {
+    link_remove(&timer->link);
+    timer->is_pending = 0;
+  }
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+static unsigned long elapsed_ticks(const struct TimerWheel *wheel)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  long long elapsed_ms =
+      (long long)(now.tv_sec - wheel->start.tv_sec) * 1000 + (now.tv_nsec - wheel->start.tv_nsec) / 1000000;
+  return (unsigned long)(elapsed_ms / TIMER_TICK_MS);
+}
+
+// Must be called with wheel->mutex held
+static void wheel_insert(struct TimerWheel *wheel, struct Timer *timer)
+{
+  unsigned long now   = atomic_load_explicit(&wheel->now, memory_order_relaxed);
+  unsigned long delta = timer->expires - now;
+  if ((long)delta < 0) {
+    // Already due (e.g. while cascading), dispatch with the current slot
+    timer->expires = now;
+    delta          = 0;
+  }
+
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1UL << ((level + 1) * TIMER_WHEEL_BITS)) {
+    level++;
+  }
+
+  unsigned long max_delta = (1UL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+  if (delta > max_delta) {
+    timer->expires = now + max_delta; // Clamp to the wheel's range, the owner re-arms on expiry
+  }
+
+  int slot = (int)((timer->expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+  link_add_tail(&wheel->slots[level][slot], &timer->link);
+}
+
+// Must be called with wheel->mutex held
+static void wheel_advance(struct TimerWheel *wheel)
+{
+  unsigned long now = atomic_load_explicit(&wheel->now, memory_order_relaxed) + 1;
+  atomic_store_explicit(&wheel->now, now, memory_order_relaxed);
+
+  // Each time a lower level wraps around, redistribute the next slot of the level above it
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    if ((now & ((1UL << (level * TIMER_WHEEL_BITS)) - 1)) != 0) {
+      break;
+    }
+
+    struct TimerLink cascade;
+    link_init(&cascade);
+    link_splice(&wheel->slots[level][(now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK], &cascade);
+    while (!link_empty(&cascade)) {
+      struct Timer *timer = (struct Timer *)cascade.next;
+      link_remove(&timer->link);
+      wheel_insert(wheel, timer);
+    }
+  }
+
+  link_splice(&wheel->slots[0][now & TIMER_WHEEL_MASK], &wheel->expired);
+}
+
+static void *timer_thread(void *arg)
+{
+  struct TimerWheel *wheel = (struct TimerWheel *)arg;
+
+  while (1) {
+    struct timespec delay = {0, TIMER_TICK_MS * 1000000L};
+    nanosleep(&delay, NULL);
+
+    unsigned long target = elapsed_ticks(wheel);
+
+    pthread_mutex_lock(&wheel->mutex);
+    while (atomic_load_explicit(&wheel->now, memory_order_relaxed) < target) {
+      wheel_advance(wheel);
+    }
+
+    // Callbacks run unlocked so they can re-arm timers and take other locks
+    while (!link_empty(&wheel->expired)) {
+      struct Timer *timer = (struct Timer *)wheel->expired.next;
+      link_remove(&timer->link);
+      timer->is_pending = 0;
+      wheel->running    = timer;
+      pthread_mutex_unlock(&wheel->mutex);
+
+      timer->callback(timer, timer->arg);
+
+      pthread_mutex_lock(&wheel->mutex);
+      wheel->running = NULL;
+      pthread_cond_broadcast(&wheel->callback_done);
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+  }
+
+  return NULL;
+}